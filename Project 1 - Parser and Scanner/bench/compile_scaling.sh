@@ -0,0 +1,98 @@
+#!/bin/sh
+# Measures how the compile time of p1 scales with one parameter of the
+# synthetic programs of gen_program.sh: for every value it reports the total
+# and IR generation seconds, the instructions the parser generated and the
+# ones left in the module written, the peak RSS and the number of matrices,
+# with the growth exponent of the time, instructions and RSS from the previous
+# value (1 is linear, 2 quadratic).
+#
+# Usage: compile_scaling.sh path/to/p1 parameter "values" [extra p1 options...]
+#   parameter   statements, dim, depth or seed
+#   e.g. compile_scaling.sh ./p1 statements "250 500 1000 2000"
+#        DIM=8 MIX=product:1,det:1 compile_scaling.sh ./p1 depth "1 2 3 4" -O2
+#
+# The parameters which are not swept come from the environment: STATEMENTS
+# (default 100), DIM (4), DEPTH (2), MIX and SEED, see gen_program.sh. With
+# MAX_EXPONENT set, the script fails if any growth exponent is bigger, to
+# catch compile-time regressions in scripts.
+
+P1=$1
+PARAM=$2
+VALUES=$3
+[ $# -ge 3 ] && shift 3 || shift $#
+EXTRA="$*"
+
+if [ -z "$P1" ] || [ ! -x "$P1" ] || [ -z "$VALUES" ]; then
+  echo "Usage: $0 path/to/p1 statements|dim|depth|seed \"values\" [extra p1 options...]"
+  exit 1
+fi
+
+GEN="$(dirname "$0")/gen_program.sh"
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+STATEMENTS=${STATEMENTS:-100}
+DIM=${DIM:-4}
+DEPTH=${DEPTH:-2}
+MIX=${MIX:-product:2,add:2,transpose:1,invert:1,det:1,reduce:1}
+SEED=${SEED:-1}
+
+# Field of the JSON profile.
+field() {
+  grep -o "\"$1\": [0-9.]*" "$WORK/profile.json" | head -1 | sed 's/.*: //'
+}
+
+# Growth exponent between two measurements of two parameter values.
+exponent() {
+  awk -v y0="$1" -v y1="$2" -v x0="$3" -v x1="$4" 'BEGIN {
+    if (y0 > 0 && y1 > 0 && x0 > 0 && x1 > 0 && x1 != x0)
+      printf "%.2f", log(y1 / y0) / log(x1 / x0)
+    else
+      printf "-"
+  }'
+}
+
+echo "$PARAM sweep, statements=$STATEMENTS dim=$DIM depth=$DEPTH mix=$MIX seed=$SEED $EXTRA"
+printf "%10s %10s %10s %12s %12s %10s %9s %7s %7s %7s\n" "$PARAM" total ir instructions module rss_kb matrices "t exp" "i exp" "m exp"
+status=0
+prev=""
+for value in $VALUES; do
+  case $PARAM in
+    statements) STATEMENTS=$value ;;
+    dim)        DIM=$value ;;
+    depth)      DEPTH=$value ;;
+    seed)       SEED=$value ;;
+    *) echo "Unknown parameter $PARAM"; exit 1 ;;
+  esac
+  sh "$GEN" "$STATEMENTS" "$DIM" "$DEPTH" "$MIX" "$SEED" > "$WORK/prog.p1"
+  if ! "$P1" -profile=json $EXTRA "$WORK/prog.p1" "$WORK/prog.bc" > "$WORK/profile.json" 2>&1; then
+    echo "$PARAM=$value: p1 failed"
+    tail -3 "$WORK/profile.json"
+    exit 1
+  fi
+  total=$(field total)
+  ir=$(field ir)
+  instructions=$(field instructions)
+  module=$(field module_instructions)
+  rss=$(field peak_rss_kb)
+  matrices=$(field matrices)
+  if [ -n "$prev" ]; then
+    texp=$(exponent "$ptotal" "$total" "$prev" "$value")
+    iexp=$(exponent "$pinstructions" "$instructions" "$prev" "$value")
+    mexp=$(exponent "$prss" "$rss" "$prev" "$value")
+  else
+    texp=-; iexp=-; mexp=-
+  fi
+  printf "%10s %10s %10s %12s %12s %10s %9s %7s %7s %7s\n" "$value" "$total" "$ir" "$instructions" "$module" "$rss" \
+    "$matrices" "$texp" "$iexp" "$mexp"
+  if [ -n "$MAX_EXPONENT" ]; then
+    for e in $texp $iexp $mexp; do
+      if awk -v e="$e" -v max="$MAX_EXPONENT" 'BEGIN { exit !(e != "-" && e + 0 > max + 0) }'; then
+        echo "$PARAM=$value: growth exponent $e is above $MAX_EXPONENT"
+        status=1
+      fi
+    done
+  fi
+  prev=$value; ptotal=$total; pinstructions=$instructions; prss=$rss
+done
+exit $status
@@ -0,0 +1,98 @@
+#!/bin/sh
+# Writes a synthetic p1 program to stdout, for measuring how the compile time
+# scales with the size and the shape of the input.
+#
+# Usage: gen_program.sh [statements] [dim] [depth] [mix] [seed]
+#   statements  number of assignments (default 100)
+#   dim         the matrices are dim x dim (default 4)
+#   depth       depth of the expression of every assignment (default 2)
+#   mix         weights of the operations, op:weight separated by commas,
+#               from product, add, transpose, invert, det and reduce
+#               (default product:2,add:2,transpose:1,invert:1,det:1,reduce:1)
+#   seed        seed of the random choices (default 1)
+#   e.g. gen_program.sh 1000 8 3 product:1,det:1 > prog.p1
+#
+# det and reduce statements assign a scalar, the others a new matrix. The
+# operands are picked among the matrices and scalars assigned so far, so the
+# program keeps all of them live and returns a sum over the last ones.
+
+awk -v statements="${1:-100}" -v dim="${2:-4}" -v depth="${3:-2}" \
+    -v mix="${4:-product:2,add:2,transpose:1,invert:1,det:1,reduce:1}" -v seed="${5:-1}" '
+function pick(n) { return int(rand() * n) }
+
+# Operation picked by the weights of the mix.
+function op(    r, i) {
+  r = rand() * total
+  for (i = 1; i <= ops; i++) {
+    if (r < weight[i])
+      return name[i]
+    r -= weight[i]
+  }
+  return name[ops]
+}
+
+# Matrix operation picked by the weights, det and reduce are left out.
+function matrix_op(    o, tries) {
+  for (tries = 0; tries < 100; tries++) {
+    o = op()
+    if (o != "det" && o != "reduce")
+      return o
+  }
+  return "add"
+}
+
+# Matrix expression of the given depth, the leaves are assigned matrices.
+function mexpr(d, o) {
+  if (d <= 0)
+    return "m" pick(matrices)
+  if (o == "")
+    o = matrix_op()
+  if (o == "product")
+    return "(" mexpr(d - 1) " * " mexpr(d - 1) ")"
+  if (o == "add")
+    return "(" mexpr(d - 1) (rand() < 0.5 ? " + " : " - ") mexpr(d - 1) ")"
+  return o "(" mexpr(d - 1) ")"
+}
+
+# Literal matrix with the argument on the diagonal.
+function literal(    i, j, row, text) {
+  text = "matrix [" dim " x " dim "] {"
+  for (i = 0; i < dim; i++) {
+    row = ""
+    for (j = 0; j < dim; j++)
+      row = row (j ? "," : "") (i == j ? "s" : (pick(19) - 9) "." pick(10))
+    text = text (i ? "," : "") "[" row "]"
+  }
+  return text "}"
+}
+
+BEGIN {
+  srand(seed)
+  n = split(mix, parts, ",")
+  for (i = 1; i <= n; i++) {
+    split(parts[i], kv, ":")
+    ops++
+    name[ops] = kv[1]
+    weight[ops] = kv[2] == "" ? 1 : kv[2] + 0
+    total += weight[ops]
+  }
+  printf "gen(s)\n{\n"
+  matrices = 2
+  printf "  m0 = %s;\n", literal()
+  printf "  m1 = %s;\n", literal()
+  scalars = 1
+  printf "  v0 = s * 0.5;\n"
+  for (k = 0; k < statements; k++) {
+    o = op()
+    if (o == "det" || o == "reduce") {
+      e = mexpr(depth - 1)
+      printf "  v%d = %s(%s) * 0.5 + v%d;\n", scalars, o, e, pick(scalars)
+      scalars++
+    } else {
+      e = mexpr(depth < 1 ? 1 : depth, o)
+      printf "  m%d = %s;\n", matrices, e
+      matrices++
+    }
+  }
+  printf "  r = reduce(m%d) + v%d;\n  return r;\n}\n", matrices - 1, scalars - 1
+}'
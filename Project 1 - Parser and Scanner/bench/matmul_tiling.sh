@@ -0,0 +1,79 @@
+#!/bin/sh
+# Compares the blocked (tiled) matrix product generated by p1 against the plain
+# i-j-k loop nest on an N x N product.
+#
+# Usage: matmul_tiling.sh path/to/p1 [N] [extra p1 options...]
+#   e.g. matmul_tiling.sh ./p1 512 -simd-width=8
+#
+# Needs llc and a C compiler (cc) on the PATH.
+
+P1=$1
+N=${2:-256}
+[ $# -ge 2 ] && shift 2 || shift 1
+EXTRA="$*"
+
+if [ -z "$P1" ] || [ ! -x "$P1" ]; then
+  echo "Usage: $0 path/to/p1 [N] [extra p1 options...]"
+  exit 1
+fi
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# Kernel: product of two N x N matrices, reduced to a float. The operands are
+# built from short vector literals (an outer product and its transpose) because
+# N x N literals make llc spend minutes on the initialization block.
+awk -v n="$N" 'BEGIN {
+  printf "mm(s)\n{\n  u = matrix [%d x 1] {", n;
+  for (i = 0; i < n; i++)
+    printf "%s[%d.%d]", (i ? "," : ""), i % 5, (i * 7) % 10;
+  printf "};\n  v = matrix [1 x %d] {[", n;
+  for (j = 0; j < n; j++)
+    printf "%s%d.%d", (j ? "," : ""), (j * 3) % 5, j % 10;
+  printf "]};\n";
+  printf "  a = u * v;\n  b = transpose(a);\n  c = a * b;\n  r = reduce(c) * s;\n  return r;\n}\n";
+}' > "$WORK/mm.p1"
+
+cat > "$WORK/driver.c" <<'DRIVER'
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+float mm(float);
+int main(int argc, char **argv)
+{
+  int n = atoi(argv[1]);
+  int reps = 1;
+  struct timespec t0, t1;
+  float result = mm(1.0f);
+  volatile float sink;
+  double seconds = 0;
+  /* Repeat until the measurement takes at least half a second. */
+  while (1) {
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < reps; i++)
+      sink = mm(1.0f);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+    if (seconds > 0.5)
+      break;
+    reps *= 2;
+  }
+  double per_call = seconds / reps;
+  printf("%10.3f ms/call %8.2f GFLOP/s (result %g)\n", per_call * 1e3,
+         2.0 * n * n * n / per_call * 1e-9, result);
+  return 0;
+}
+DRIVER
+
+run() {
+  name=$1; shift
+  "$P1" "$@" "$WORK/mm.p1" "$WORK/$name.bc" > "$WORK/$name.log" 2>&1 || { echo "$name: p1 failed"; tail -3 "$WORK/$name.log"; exit 1; }
+  llc -O2 -relocation-model=pic -filetype=obj "$WORK/$name.bc" -o "$WORK/$name.o" || exit 1
+  cc -O2 "$WORK/driver.c" "$WORK/$name.o" -o "$WORK/$name" || exit 1
+  printf "%-8s" "$name"
+  "$WORK/$name" "$N"
+}
+
+echo "${N}x${N} matrix product $EXTRA"
+run naive -tile-size=0 $EXTRA
+run tiled $EXTRA
@@ -0,0 +1,114 @@
+#!/bin/sh
+# Finds the matrix size from which the libp1rt kernels beat the code p1
+# generates inline, for the product, determinant, inverse, transpose and
+# reduction of N x N matrix arguments. Prints the time per call of both and
+# the N from which the kernel wins, which is the -runtime-cutoff to use on this
+# machine.
+#
+# Usage: runtime_crossover.sh path/to/p1 [sizes] [extra p1 options...]
+#   e.g. runtime_crossover.sh ./p1 "16 32 64 128 256" -simd-width=8
+#
+# Needs a C and a C++ compiler (cc, c++) on the PATH. The runtime is built
+# with -O2 -march=native and the generated code with -O2 for the host CPU.
+
+P1=$1
+SIZES=${2:-"8 16 32 64 128 256"}
+[ $# -ge 2 ] && shift 2 || shift 1
+EXTRA="$*"
+
+if [ -z "$P1" ] || [ ! -x "$P1" ]; then
+  echo "Usage: $0 path/to/p1 [sizes] [extra p1 options...]"
+  exit 1
+fi
+
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+c++ -O2 -march=native -c "$SRC/p1rt.cpp" -o "$WORK/p1rt.o" || exit 1
+
+# Driver: calls the kernel with diagonally dominant operands, so the
+# determinant and the inverse stay finite, and prints the ns per call.
+cat > "$WORK/driver.c" <<'DRIVER'
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#if OPERANDS == 1
+float k(float *, int, int);
+#define CALL k(a, n, n)
+#else
+float k(float *, int, int, float *, int, int);
+#define CALL k(a, n, n, b, n, n)
+#endif
+int main(int argc, char **argv)
+{
+  int n = atoi(argv[1]);
+  float *a = malloc(sizeof(float) * n * n), *b = malloc(sizeof(float) * n * n);
+  srand(1);
+  for (int i = 0; i < n * n; i++) {
+    a[i] = (rand() / (float)RAND_MAX - 0.5f) / n + (i % (n + 1) == 0);
+    b[i] = (rand() / (float)RAND_MAX - 0.5f) / n + (i % (n + 1) == 0);
+  }
+  int reps = 1;
+  struct timespec t0, t1;
+  volatile float sink = CALL;
+  double seconds = 0;
+  /* Repeat until the measurement takes at least a fifth of a second. */
+  while (1) {
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < reps; i++)
+      sink = CALL;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+    if (seconds > 0.2)
+      break;
+    reps *= 2;
+  }
+  (void)sink;
+  printf("%.0f\n", seconds / reps * 1e9);
+  return 0;
+}
+DRIVER
+
+# Kernel of an operation on N x N arguments. The matrix results are summed,
+# otherwise the optimizer only computes the elements which are returned, so
+# the product, inverse and transpose rows include a reduction.
+kernel() {
+  case $1 in
+    product)   printf "k(a [%d x %d], b [%d x %d])\n{\n  r = reduce(a * b);\n  return r;\n}\n" $2 $2 $2 $2 ;;
+    det)       printf "k(a [%d x %d])\n{\n  r = det(a);\n  return r;\n}\n" $2 $2 ;;
+    invert)    printf "k(a [%d x %d])\n{\n  r = reduce(invert(a));\n  return r;\n}\n" $2 $2 ;;
+    transpose) printf "k(a [%d x %d])\n{\n  r = reduce(transpose(a));\n  return r;\n}\n" $2 $2 ;;
+    reduce)    printf "k(a [%d x %d])\n{\n  r = reduce(a);\n  return r;\n}\n" $2 $2 ;;
+  esac
+}
+
+# Time per call of one operation at size N, with the given p1 options.
+measure() {
+  op=$1; n=$2; shift 2
+  kernel $op $n > "$WORK/k.p1"
+  "$P1" -O2 $EXTRA "$@" "$WORK/k.p1" "$WORK/k.o" > "$WORK/p1.log" 2>&1 || { echo "p1 failed"; return; }
+  operands=1; [ $op = product ] && operands=2
+  cc -O2 -DOPERANDS=$operands "$WORK/driver.c" "$WORK/k.o" "$WORK/p1rt.o" -lstdc++ -lm -o "$WORK/k" || return
+  "$WORK/k" $n
+}
+
+echo "ns per call of the inline code and of libp1rt $EXTRA"
+for op in product det invert transpose reduce; do
+  printf "%-10s %6s %14s %14s %8s\n" $op N inline libp1rt speedup
+  cutoff=""
+  for n in $SIZES; do
+    inline=$(measure $op $n)
+    runtime=$(measure $op $n -runtime-cutoff=1)
+    speedup=$(awk -v a="$inline" -v b="$runtime" 'BEGIN { if (b > 0) printf "%.2f", a / b }')
+    printf "%-10s %6d %14s %14s %8s\n" "" $n "$inline" "$runtime" "$speedup"
+    # The crossover is the smallest N from which the kernel wins at every
+    # larger size, so one noisy small size doesn't count.
+    if awk -v s="$speedup" 'BEGIN { exit !(s > 1) }'; then
+      cutoff=${cutoff:-$n}
+    else
+      cutoff=""
+    fi
+  done
+  echo "$op: libp1rt is faster from N = ${cutoff:-none of these sizes}"
+done
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Measures the tokens per second of the p1 scanner on a large generated input:
+# scanning the memory mapped file, reading it from stdin through yyin, and
+# with token tracing on (printed to /dev/null).
+#
+# Usage: scan_throughput.sh path/to/p1 [statements]
+#   e.g. scan_throughput.sh ./p1 500000
+
+P1=$1
+STATEMENTS=${2:-200000}
+
+if [ -z "$P1" ] || [ ! -x "$P1" ]; then
+  echo "Usage: $0 path/to/p1 [statements]"
+  exit 1
+fi
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# Input: a function with many scalar and small matrix statements.
+awk -v n="$STATEMENTS" 'BEGIN {
+  printf "scan(a,b)\n{\n";
+  for (i = 0; i < n; i++) {
+    if (i % 4 == 0)
+      printf "  m%d = matrix [2 x 2] { [a,%d.5],[%d,b] };\n", i, i % 10, i % 7;
+    else
+      printf "  v%d = a * %d.25 + b / %d - reduce(m%d) * 0.5;\n", i, i % 9, i % 5 + 1, i - i % 4;
+  }
+  printf "  return a;\n}\n";
+}' > "$WORK/scan.p1"
+
+echo "$(wc -c < "$WORK/scan.p1") bytes, $STATEMENTS statements"
+printf "mapped file:  "; "$P1" -scan-only "$WORK/scan.p1"
+printf "stdin (yyin): "; "$P1" -scan-only -- < "$WORK/scan.p1"
+printf "traced:       "; "$P1" -trace -scan-only "$WORK/scan.p1" 2>/dev/null | tail -1
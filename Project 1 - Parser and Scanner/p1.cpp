@@ -1,7 +1,18 @@
 #include <iostream>
 #include <unistd.h>
+#include <sys/resource.h>
 #include <memory>
 #include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Value.h"
@@ -14,45 +25,989 @@
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/Host.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/IR/LegacyPassManager.h"
+
+#include "p1.h"
+#include "p1rt.h"
 
 using namespace llvm;
 using namespace std;
 
-extern FILE *yyin;
+// Formats of the output files
+enum output_kind { OUTPUT_BITCODE, OUTPUT_OBJECT, OUTPUT_ASSEMBLY };
+
+// Code generation: options of what is done with the module of a p1 file before it is written
+struct codegen_options
+{
+  // Optimization level, 0 to 3
+  int opt_level = 0;
+  // Target CPU and features in the -mattr syntax (+avx2,-fma). An empty or "native" CPU is the host CPU, whose
+  // features come first so -mattr can change them.
+  std::string cpu;
+  std::string attrs;
+  // Output format given with -filetype, otherwise it is picked from the extension of the output file
+  output_kind kind = OUTPUT_BITCODE;
+  bool kind_set = false;
+};
+
+// Batch mode: options of a batch compilation
+struct batch_options
+{
+  // Number of worker threads
+  unsigned jobs = std::max(1u,std::thread::hardware_concurrency());
+  // Directory of the output files, next to the inputs if empty
+  std::string out_dir;
+  // Single module all the inputs are linked into, one output per input if empty
+  std::string link_file;
+};
+
+// Format of an output file: the one of -filetype, otherwise .o is an object file, .s assembly and anything else bitcode
+static output_kind outputKind(const codegen_options &Codegen, StringRef Filename)
+{
+  if (Codegen.kind_set)
+    return Codegen.kind;
+  if (Filename.endswith(".o"))
+    return OUTPUT_OBJECT;
+  if (Filename.endswith(".s"))
+    return OUTPUT_ASSEMBLY;
+  return OUTPUT_BITCODE;
+}
+
+static const char *outputExtension(output_kind Kind)
+{
+  return Kind == OUTPUT_OBJECT ? ".o" : Kind == OUTPUT_ASSEMBLY ? ".s" : ".bc";
+}
+
+// Native code and the optimizations need a TargetMachine, bitcode at -O0 stays target independent
+static bool needsTarget(const codegen_options &Codegen, output_kind Kind)
+{
+  return Codegen.opt_level > 0 || Kind != OUTPUT_BITCODE;
+}
+
+// Compilation cache: the output of every compilation is kept in a directory under a hash of the source, the compiler
+// and the options, so unchanged inputs are not compiled again.
+struct cache_options
+{
+  // Directory of the cache, empty disables the cache
+  std::string dir;
+  // The least recently used entries are evicted once the cache holds more than this
+  uint64_t max_bytes = 256ull << 20;
+  // Report the hits and misses and the size of the cache
+  bool stats = false;
+};
+
+// Identifies the compiler in the cache keys. The executable stands for its version: a rebuild of p1 changes its size
+// or its modification time.
+static const std::string &compilerIdentity()
+{
+  static const std::string Identity = [] {
+    std::string Result = "p1 LLVM " LLVM_VERSION_STRING;
+    sys::fs::file_status Status;
+    if (!sys::fs::status(sys::fs::getMainExecutable(nullptr,(void*)&compilerIdentity),Status))
+      Result += " " + std::to_string(Status.getSize()) + " " +
+                std::to_string(Status.getLastModificationTime().time_since_epoch().count());
+    return Result;
+  }();
+  return Identity;
+}
+
+// Path of the cache entry of a compilation, empty if the input can't be read. The key hashes the compiler, every
+// option which changes the generated code, the target and output format (see targetKey), the module name and the
+// source: the module name comes from the file name (see parseP1File), so inputs with the same contents and different
+// names get their own entries. The entries are named llvmcache-* for pruneCache.
+static std::string cacheEntry(const cache_options &Cache, const std::string &InputFilename, const p1_options &options,
+                              const std::string &Target)
+{
+  ErrorOr<std::unique_ptr<MemoryBuffer>> Source = MemoryBuffer::getFile(InputFilename);
+  if (!Source)
+    return "";
+  std::string Options;
+  raw_string_ostream OS(Options);
+  OS << options.loop_threshold << ' ' << options.simd_width << ' ' << options.tile_size << ' ' << options.runtime_cutoff
+     << ' ' << options.fold << ' ' << options.value_numbering << ' ' << options.chain_order << ' ' << options.fast_math
+     << ' ' << options.batch_kernel << ' ' << options.structure << ' ' << Target;
+  SHA1 Hash;
+  Hash.update(compilerIdentity());
+  Hash.update(StringRef("\0",1));
+  Hash.update(OS.str());
+  Hash.update(StringRef("\0",1));
+  Hash.update(sys::path::stem(InputFilename));
+  Hash.update(StringRef("\0",1));
+  Hash.update((*Source)->getBuffer());
+  return Cache.dir + "/llvmcache-" + toHex(Hash.final(),true);
+}
+
+// Marks a cache entry as just used, the eviction goes by the access times. Returns false if there is no such entry.
+static bool touchCached(const std::string &Entry)
+{
+  int FD;
+  if (sys::fs::openFileForRead(Entry,FD))
+    return false;
+  sys::fs::setLastAccessAndModificationTime(FD,std::chrono::system_clock::now());
+  sys::Process::SafelyCloseFileDescriptor(FD);
+  return true;
+}
+
+// Gives OutputFilename the output stored in a cache entry, hard linked or else copied. Returns false on a miss.
+static bool fetchCached(const std::string &Entry, const std::string &OutputFilename)
+{
+  if (!touchCached(Entry))
+    return false;
+  sys::fs::remove(OutputFilename);
+  return !sys::fs::create_hard_link(Entry,OutputFilename) || !sys::fs::copy_file(Entry,OutputFilename);
+}
+
+// Removes an output file before it is written. An earlier cache hit may have made it a hard link to a cache entry,
+// which writing in place would change for every later hit, also when this compilation doesn't use the cache.
+static void removeOutput(const std::string &OutputFilename)
+{
+  if (OutputFilename != "-")
+    sys::fs::remove(OutputFilename);
+}
+
+// Adds the output of a compilation to the cache. It is written under a temporary name and renamed, so concurrent
+// compilations never see partial entries.
+static void storeCached(const cache_options &Cache, const std::string &Entry, StringRef Output)
+{
+  int FD;
+  SmallString<128> Temp;
+  if (sys::fs::createUniqueFile(Cache.dir + "/p1-%%%%%%%%.tmp",FD,Temp))
+    return;
+  {
+    raw_fd_ostream OS(FD,true);
+    OS << Output;
+  }
+  if (sys::fs::rename(Temp,Entry))
+    sys::fs::remove(Temp);
+}
+
+// Evicts the least recently used entries until the cache fits in its size limit
+static void evictCached(const cache_options &Cache)
+{
+  CachePruningPolicy Policy;
+  Policy.Interval = std::chrono::seconds(0);
+  Policy.Expiration = std::chrono::seconds(0);
+  Policy.MaxSizePercentageOfAvailableSpace = 0;
+  Policy.MaxSizeBytes = Cache.max_bytes;
+  Policy.MaxSizeFiles = 0;
+  pruneCache(Cache.dir,Policy);
+}
+
+// Reports the hits and misses of a run and what the cache holds
+static void reportCache(const cache_options &Cache, int Hits, int Misses)
+{
+  uint64_t Entries = 0, Bytes = 0;
+  std::error_code EC;
+  for (sys::fs::directory_iterator I(Cache.dir,EC), E; I != E && !EC; I.increment(EC)) {
+    uint64_t Size;
+    if (sys::path::filename(I->path()).startswith("llvmcache-") && !sys::fs::file_size(I->path(),Size)) {
+      Entries++;
+      Bytes += Size;
+    }
+  }
+  fprintf(stdout,"cache: %d hits, %d misses, %llu entries, %.1f KB of %.1f KB\n",Hits,Misses,
+          (unsigned long long)Entries,Bytes/1024.0,Cache.max_bytes/1024.0);
+}
+
+// Creates a TargetMachine for the host triple and the CPU and features of the options, by default the host CPU and
+// its features, so the generated code uses the vector units which are really there (AVX2, AVX-512). Returns NULL if
+// LLVM was built without the host target.
+static std::unique_ptr<TargetMachine> createTargetMachine(const codegen_options &Codegen)
+{
+  std::string Triple = sys::getDefaultTargetTriple();
+  std::string Error;
+  const Target *T = TargetRegistry::lookupTarget(Triple,Error);
+  if (T == nullptr) {
+    errs() << Error << "\n";
+    return nullptr;
+  }
+  bool Host = Codegen.cpu.empty() || Codegen.cpu == "native";
+  if (!Host && !std::unique_ptr<MCSubtargetInfo>(T->createMCSubtargetInfo(Triple,"",""))->isCPUStringValid(Codegen.cpu)) {
+    errs() << "Unknown CPU " << Codegen.cpu << " for " << Triple << "\n";
+    return nullptr;
+  }
+  SubtargetFeatures Features;
+  StringMap<bool> HostFeatures;
+  if (Host && sys::getHostCPUFeatures(HostFeatures))
+    for (auto &Feature : HostFeatures)
+      Features.AddFeature(Feature.first(),Feature.second);
+  // Later features override earlier ones
+  SmallVector<StringRef,8> Attrs;
+  StringRef(Codegen.attrs).split(Attrs,',',-1,false);
+  for (StringRef Attr : Attrs)
+    Features.AddFeature(Attr);
+  CodeGenOpt::Level Level = Codegen.opt_level == 0 ? CodeGenOpt::None
+                          : Codegen.opt_level == 1 ? CodeGenOpt::Less
+                          : Codegen.opt_level == 2 ? CodeGenOpt::Default : CodeGenOpt::Aggressive;
+  return std::unique_ptr<TargetMachine>(T->createTargetMachine(Triple,Host ? sys::getHostCPUName() : Codegen.cpu,
+                                                               Features.getString(),TargetOptions(),Reloc::PIC_,None,
+                                                               Level));
+}
+
+// Part of the cache keys for the target and the format of the outputs
+static std::string targetKey(const codegen_options &Codegen, output_kind Kind, const TargetMachine *TM)
+{
+  std::string Key = "-O" + std::to_string(Codegen.opt_level) + outputExtension(Kind);
+  if (TM)
+    Key += " " + TM->getTargetTriple().str() + " " + TM->getTargetCPU().str() + " " + TM->getTargetFeatureString().str();
+  return Key;
+}
+
+// Runs the default pipeline of the new pass manager for O1 to O3 over the module, with the loop and SLP vectorizers
+// from O2 on. O0 leaves the code as parsed, except that it runs the O0 pipeline, which inlines the always inline
+// functions, if there are any: the function of the batch kernel is one. With a TargetMachine the module gets its triple and data layout, which the
+// cost models of the vectorizers and the code generator need.
+static void optimizeModule(Module &M, int OptLevel, TargetMachine *TM)
+{
+  if (TM) {
+    M.setTargetTriple(TM->getTargetTriple().str());
+    M.setDataLayout(TM->createDataLayout());
+  }
+  if (OptLevel == 0 && std::none_of(M.begin(),M.end(),[](const Function &F) {
+        return F.hasFnAttribute(Attribute::AlwaysInline);
+      }))
+    return;
+
+  PipelineTuningOptions Tuning;
+  Tuning.LoopVectorization = OptLevel >= 2;
+  Tuning.SLPVectorization = OptLevel >= 2;
+  PassBuilder PB(TM,Tuning);
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM,FAM,CGAM,MAM);
+
+  if (OptLevel == 0) {
+    ModulePassManager MPM = PB.buildO0DefaultPipeline(OptimizationLevel::O0);
+    MPM.run(M,MAM);
+    return;
+  }
+  OptimizationLevel Level = OptLevel == 1 ? OptimizationLevel::O1
+                          : OptLevel == 2 ? OptimizationLevel::O2 : OptimizationLevel::O3;
+  ModulePassManager MPM = PB.buildPerModuleDefaultPipeline(Level);
+  MPM.run(M,MAM);
+}
+
+// Writes the module as bitcode, or as an object file or assembly through the code generator of the TargetMachine.
+// Returns false if the target can't emit that kind of file.
+static bool writeModule(Module &M, TargetMachine *TM, output_kind Kind, raw_pwrite_stream &OS)
+{
+  if (Kind == OUTPUT_BITCODE) {
+    WriteBitcodeToFile(M,OS);
+    return true;
+  }
+  // The code generator still runs on the legacy pass manager
+  legacy::PassManager PM;
+  if (TM->addPassesToEmitFile(PM,OS,nullptr,Kind == OUTPUT_OBJECT ? CGFT_ObjectFile : CGFT_AssemblyFile)) {
+    errs() << "The target can't emit this kind of file\n";
+    return false;
+  }
+  PM.run(M);
+  return true;
+}
+
+// Expands the inputs of a batch: directories give their .p1 files (sorted), @file gives the paths listed in the file
+// one per line, anything else is taken as a p1 file.
+static bool collectInputs(const std::string &Arg, std::vector<std::string> &Inputs)
+{
+  if (Arg[0] == '@') {
+    std::ifstream List(Arg.substr(1));
+    if (!List) {
+      fprintf(stdout,"Can't read %s\n",Arg.c_str()+1);
+      return false;
+    }
+    std::string Line;
+    while (std::getline(List,Line))
+      if (!Line.empty() && !collectInputs(Line,Inputs))
+        return false;
+    return true;
+  }
+  if (sys::fs::is_directory(Arg)) {
+    std::vector<std::string> Files;
+    std::error_code EC;
+    for (sys::fs::directory_iterator I(Arg,EC), E; I != E && !EC; I.increment(EC))
+      if (StringRef(I->path()).endswith(".p1"))
+        Files.push_back(I->path());
+    std::sort(Files.begin(),Files.end());
+    Inputs.insert(Inputs.end(),Files.begin(),Files.end());
+    return true;
+  }
+  Inputs.push_back(Arg);
+  return true;
+}
+
+// Work-stealing pool. The tasks 0 to Count-1 are dealt to one queue per worker. A worker takes tasks from the back
+// of its own queue and, once it is empty, steals from the front of the other queues, so workers which got cheap
+// tasks help the ones which got expensive ones.
+struct work_queue
+{
+  std::mutex Lock;
+  std::deque<int> Tasks;
+};
+
+static void runTasks(int Count, unsigned Jobs, const std::function<void(int)> &Task)
+{
+  std::vector<work_queue> Queues(Jobs);
+  for (int i = 0; i < Count; i++)
+    Queues[i % Jobs].Tasks.push_back(i);
+
+  // Takes a task from queue Q, from the back for its owner and from the front for thieves
+  auto take = [&](unsigned Q, bool Own, int &T) {
+    std::lock_guard<std::mutex> Guard(Queues[Q].Lock);
+    if (Queues[Q].Tasks.empty())
+      return false;
+    if (Own) {
+      T = Queues[Q].Tasks.back();
+      Queues[Q].Tasks.pop_back();
+    } else {
+      T = Queues[Q].Tasks.front();
+      Queues[Q].Tasks.pop_front();
+    }
+    return true;
+  };
+
+  std::vector<std::thread> Workers;
+  for (unsigned w = 0; w < Jobs; w++)
+    Workers.emplace_back([&,w] {
+      int T;
+      for (;;) {
+        bool Found = take(w,true,T);
+        for (unsigned v = 1; !Found && v < Jobs; v++)
+          Found = take((w+v) % Jobs,false,T);
+        // No task is added while the pool runs, so empty queues mean the work is done
+        if (!Found)
+          return;
+        Task(T);
+      }
+    });
+  for (auto &W : Workers)
+    W.join();
+}
+
+// Compiles all the inputs in parallel, every task with its own LLVMContext and TargetMachine. Writes one output per
+// input, in the format of -filetype (bitcode by default), or links all the modules into link_file, whose extension
+// gives the format, then reports the throughput. With a cache, inputs found in it are not compiled.
+static int compileBatch(const std::vector<std::string> &Inputs, const batch_options &Batch, const cache_options &Cache,
+                        const codegen_options &Codegen, const p1_options &options)
+{
+  int Count = Inputs.size();
+  std::vector<SmallVector<char,0>> Bitcode(Count);
+  std::vector<char> Failed(Count,0);
+  std::vector<uint64_t> Bytes(Count,0);
+  std::atomic<int> Hits(0);
+  // Linked modules are kept as bitcode until they are linked, and written in the format of link_file
+  output_kind Kind = Batch.link_file.empty() ? outputKind(Codegen,"") : OUTPUT_BITCODE;
+  std::string Target;
+  {
+    std::unique_ptr<TargetMachine> TM = needsTarget(Codegen,Kind) ? createTargetMachine(Codegen) : nullptr;
+    if (needsTarget(Codegen,Kind) && !TM)
+      return 1;
+    Target = targetKey(Codegen,Kind,TM.get());
+  }
+
+  auto Start = std::chrono::steady_clock::now();
+  runTasks(Count,Batch.jobs,[&](int i) {
+    sys::fs::file_size(Inputs[i],Bytes[i]);
+    std::string OutputFilename;
+    if (Batch.link_file.empty()) {
+      std::string Name = sys::path::filename(Inputs[i]).str();
+      if (StringRef(Name).endswith(".p1"))
+        Name.resize(Name.size()-3);
+      OutputFilename = Batch.out_dir.empty()
+        ? (sys::path::parent_path(Inputs[i]).empty() ? "" : sys::path::parent_path(Inputs[i]).str() + "/") + Name
+        : Batch.out_dir + "/" + Name;
+      OutputFilename += outputExtension(Kind);
+    }
+
+    std::string Entry = Cache.dir.empty() ? "" : cacheEntry(Cache,Inputs[i],options,Target);
+    if (!Entry.empty()) {
+      if (!Batch.link_file.empty() && touchCached(Entry)) {
+        ErrorOr<std::unique_ptr<MemoryBuffer>> Cached = MemoryBuffer::getFile(Entry);
+        if (Cached) {
+          Bitcode[i].assign((*Cached)->getBufferStart(),(*Cached)->getBufferEnd());
+          Hits++;
+          return;
+        }
+      }
+      if (Batch.link_file.empty() && fetchCached(Entry,OutputFilename)) {
+        Hits++;
+        return;
+      }
+    }
+
+    LLVMContext Context;
+    unique_ptr<Module> M = parseP1File(Inputs[i],Context,options);
+    if (M.get() == nullptr) {
+      Failed[i] = 1;
+      return;
+    }
+    // TargetMachines are not shared between threads
+    std::unique_ptr<TargetMachine> TM = needsTarget(Codegen,Kind) ? createTargetMachine(Codegen) : nullptr;
+    optimizeModule(*M,Codegen.opt_level,TM.get());
+    // Kept in memory for the cache and the linker, modules of different contexts can't be linked directly
+    if (!Batch.link_file.empty() || !Entry.empty()) {
+      raw_svector_ostream OS(Bitcode[i]);
+      if (!writeModule(*M,TM.get(),Kind,OS)) {
+        Failed[i] = 1;
+        return;
+      }
+      if (!Entry.empty())
+        storeCached(Cache,Entry,StringRef(Bitcode[i].data(),Bitcode[i].size()));
+    }
+    if (Batch.link_file.empty()) {
+      removeOutput(OutputFilename);
+      std::error_code EC;
+      ToolOutputFile Out(OutputFilename,EC,Kind == OUTPUT_ASSEMBLY ? sys::fs::OF_Text : sys::fs::OF_None);
+      if (EC) {
+        fprintf(stdout,"Can't write %s: %s\n",OutputFilename.c_str(),EC.message().c_str());
+        Failed[i] = 1;
+        return;
+      }
+      if (!Entry.empty())
+        Out.os() << StringRef(Bitcode[i].data(),Bitcode[i].size());
+      else if (!writeModule(*M,TM.get(),Kind,Out.os())) {
+        Failed[i] = 1;
+        return;
+      }
+      Out.keep();
+    }
+  });
+
+  int Failures = std::count(Failed.begin(),Failed.end(),1);
+  if (!Batch.link_file.empty() && Failures == 0) {
+    LLVMContext Context;
+    Module Linked(sys::path::stem(Batch.link_file),Context);
+    Linker L(Linked);
+    for (int i = 0; i < Count; i++) {
+      Expected<unique_ptr<Module>> M = parseBitcodeFile(MemoryBufferRef(StringRef(Bitcode[i].data(),Bitcode[i].size()),Inputs[i]),Context);
+      if (!M || L.linkInModule(std::move(*M))) {
+        if (!M)
+          consumeError(M.takeError());
+        fprintf(stdout,"Can't link %s\n",Inputs[i].c_str());
+        return 1;
+      }
+    }
+    output_kind LinkKind = outputKind(Codegen,Batch.link_file);
+    std::unique_ptr<TargetMachine> TM = LinkKind != OUTPUT_BITCODE ? createTargetMachine(Codegen) : nullptr;
+    if (LinkKind != OUTPUT_BITCODE && !TM)
+      return 1;
+    if (TM) {
+      Linked.setTargetTriple(TM->getTargetTriple().str());
+      Linked.setDataLayout(TM->createDataLayout());
+    }
+    removeOutput(Batch.link_file);
+    std::error_code EC;
+    ToolOutputFile Out(Batch.link_file,EC,LinkKind == OUTPUT_ASSEMBLY ? sys::fs::OF_Text : sys::fs::OF_None);
+    if (EC) {
+      fprintf(stdout,"Can't write %s: %s\n",Batch.link_file.c_str(),EC.message().c_str());
+      return 1;
+    }
+    if (!writeModule(Linked,TM.get(),LinkKind,Out.os()))
+      return 1;
+    Out.keep();
+  }
+  double Wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+
+  uint64_t TotalBytes = 0;
+  for (int i = 0; i < Count; i++)
+    TotalBytes += Bytes[i];
+  fprintf(stdout,"Compiled %d of %d files (%.1f KB) in %.3f s on %u threads: %.1f files/sec, %.1f KB/sec\n",
+          Count-Failures,Count,TotalBytes/1024.0,Wall,Batch.jobs,Count/Wall,TotalBytes/1024.0/Wall);
+  if (!Cache.dir.empty()) {
+    evictCached(Cache);
+    if (Cache.stats)
+      reportCache(Cache,Hits,Count-Failures-Hits);
+  }
+  if (Failures) {
+    for (int i = 0; i < Count; i++)
+      if (Failed[i])
+        fprintf(stdout,"Errors in %s\n",Inputs[i].c_str());
+    return 1;
+  }
+  return 0;
+}
+
 
-unique_ptr<Module> parseP1File(const string &InputFilename);
+// Instructions of the functions of a module.
+static size_t countInstructions(const Module &M)
+{
+  size_t Count = 0;
+  for (const Function &F : M)
+    Count += F.getInstructionCount();
+  return Count;
+}
+
+// Peak resident set size of the process in KB.
+static long peakRSS()
+{
+  struct rusage Usage;
+  if (getrusage(RUSAGE_SELF,&Usage) != 0)
+    return 0;
+  return Usage.ru_maxrss;
+}
+
+// Prints the compile-time profile of a file as text or as JSON. OptimizeSeconds, WriteSeconds and TotalSeconds are
+// measured by the driver around the optimization pipeline, the writer of the output and the whole compilation.
+// ModuleInstructions is the size of the module which is written, after the optimizations, and PeakRSS the peak memory
+// of the compilation in KB.
+static void printProfile(const p1_profile &Profile, double OptimizeSeconds, double WriteSeconds, double TotalSeconds,
+                         size_t ModuleInstructions, long PeakRSS, bool Json)
+{
+  if (Json) {
+    fprintf(stdout,"{\n  \"phases\": {\"scan\": %.6f, \"parse\": %.6f, \"ir\": %.6f, \"print\": %.6f, \"optimize\": %.6f, "
+            "\"write\": %.6f, \"total\": %.6f},\n",Profile.scan_seconds,Profile.parse_seconds,Profile.ir_seconds,
+            Profile.print_seconds,OptimizeSeconds,WriteSeconds,TotalSeconds);
+    fprintf(stdout,"  \"tokens\": %ld, \"reductions\": %ld, \"instructions\": %ld, \"symbols\": %zu, \"matrices\": %zu,\n",
+            Profile.tokens,Profile.reductions,Profile.instructions,Profile.symbols,Profile.matrices);
+    fprintf(stdout,"  \"module_instructions\": %zu, \"peak_rss_kb\": %ld,\n",ModuleInstructions,PeakRSS);
+    fprintf(stdout,"  \"rules\": [");
+    const char *Separator = "\n";
+    for (auto &Rule : Profile.rules) {
+      fprintf(stdout,"%s    {\"rule\": \"%s\", \"reductions\": %ld, \"instructions\": %ld, \"seconds\": %.6f}",Separator,
+              Rule.first.c_str(),Rule.second.reductions,Rule.second.instructions,Rule.second.seconds);
+      Separator = ",\n";
+    }
+    fprintf(stdout,"\n  ]\n}\n");
+    return;
+  }
+  fprintf(stdout,"phase          seconds\n");
+  fprintf(stdout,"  scan         %.6f\n",Profile.scan_seconds);
+  fprintf(stdout,"  parse        %.6f\n",Profile.parse_seconds);
+  fprintf(stdout,"  ir           %.6f\n",Profile.ir_seconds);
+  fprintf(stdout,"  print        %.6f\n",Profile.print_seconds);
+  fprintf(stdout,"  optimize     %.6f\n",OptimizeSeconds);
+  fprintf(stdout,"  write        %.6f\n",WriteSeconds);
+  fprintf(stdout,"  total        %.6f\n",TotalSeconds);
+  fprintf(stdout,"%ld tokens, %ld reductions, %ld instructions, %zu symbols, %zu matrices\n",Profile.tokens,
+          Profile.reductions,Profile.instructions,Profile.symbols,Profile.matrices);
+  fprintf(stdout,"%zu instructions in the module written, peak RSS %ld KB\n",ModuleInstructions,PeakRSS);
+  fprintf(stdout,"%-80s %10s %12s %10s\n","rule","reductions","instructions","seconds");
+  for (auto &Rule : Profile.rules)
+    fprintf(stdout,"%-80s %10ld %12ld %10.6f\n",Rule.first.c_str(),Rule.second.reductions,Rule.second.instructions,
+            Rule.second.seconds);
+}
+
+// JIT compiles the function of the module with ORC and calls it once per argument tuple, Repeat times over. The tuples
+// are read from ArgsFile (stdin if empty), one per line with the arguments separated by spaces or commas, matrix
+// arguments as their elements in row-major order. The calls go through the batch kernel of the function with one
+// record, so any arguments are passed the same way. Reports the calls per second and the latency percentiles of
+// single calls, then the records per second of the batch kernel over all the tuples at once.
+static int runModule(unique_ptr<Module> M, unique_ptr<LLVMContext> Context, const std::string &ArgsFile, int Repeat)
+{
+  Function *F = nullptr;
+  for (auto &Fn : *M)
+    if (!Fn.isDeclaration()) {
+      F = &Fn;
+      break;
+    }
+  GlobalVariable *Inputs = F ? M->getGlobalVariable(F->getName().str() + "_inputs") : nullptr;
+  if (F == nullptr || Inputs == nullptr) {
+    fprintf(stdout,"No function to run\n");
+    return 1;
+  }
+  unsigned NumArgs = cast<ConstantInt>(Inputs->getInitializer())->getZExtValue();
+  std::string Name = F->getName().str();
+
+  // Read all the tuples first so the input is not part of the measurement
+  std::ifstream File;
+  std::istream *In = &std::cin;
+  if (!ArgsFile.empty()) {
+    File.open(ArgsFile);
+    if (!File) {
+      fprintf(stdout,"Can't read %s\n",ArgsFile.c_str());
+      return 1;
+    }
+    In = &File;
+  }
+  std::vector<float> Args;
+  size_t Tuples = 0;
+  std::string Line;
+  while (std::getline(*In,Line)) {
+    std::replace(Line.begin(),Line.end(),',',' ');
+    std::istringstream Values(Line);
+    unsigned Count = 0;
+    float Value;
+    while (Values >> Value) {
+      Args.push_back(Value);
+      Count++;
+    }
+    if (Count == 0)
+      continue;
+    if (Count != NumArgs) {
+      fprintf(stdout,"Tuple %zu has %u values, %s takes %u\n",Tuples+1,Count,Name.c_str(),NumArgs);
+      return 1;
+    }
+    Tuples++;
+  }
+  // Functions without arguments are called once per round
+  if (NumArgs == 0 && Tuples == 0)
+    Tuples = 1;
+  if (Tuples == 0) {
+    fprintf(stdout,"No argument tuples for %s\n",Name.c_str());
+    return 1;
+  }
+
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  auto J = orc::LLJITBuilder().create();
+  if (!J) {
+    errs() << toString(J.takeError()) << "\n";
+    return 1;
+  }
+  // malloc and free of large matrices come from the process, the libp1rt kernels from the driver itself
+  (*J)->getMainJITDylib().addGenerator(
+    cantFail(orc::DynamicLibrarySearchGenerator::GetForCurrentProcess((*J)->getDataLayout().getGlobalPrefix())));
+  orc::SymbolMap Runtime;
+  auto addRuntime = [&](const char *Symbol, void *Address) {
+    Runtime[(*J)->mangleAndIntern(Symbol)] = JITEvaluatedSymbol(pointerToJITTargetAddress(Address),
+                                                                JITSymbolFlags::Exported);
+  };
+  addRuntime("p1rt_gemm",(void*)&p1rt_gemm);
+  addRuntime("p1rt_det",(void*)&p1rt_det);
+  addRuntime("p1rt_invert",(void*)&p1rt_invert);
+  addRuntime("p1rt_transpose",(void*)&p1rt_transpose);
+  addRuntime("p1rt_reduce",(void*)&p1rt_reduce);
+  cantFail((*J)->getMainJITDylib().define(orc::absoluteSymbols(std::move(Runtime))));
+  if (Error E = (*J)->addIRModule(orc::ThreadSafeModule(std::move(M),std::move(Context)))) {
+    errs() << toString(std::move(E)) << "\n";
+    return 1;
+  }
+  // Looking the function up compiles it, before the timing starts
+  auto Symbol = (*J)->lookup(Name + "_batch");
+  if (!Symbol) {
+    errs() << toString(Symbol.takeError()) << "\n";
+    return 1;
+  }
+  auto Run = jitTargetAddressToFunction<void (*)(const float*,float*,int)>(Symbol->getAddress());
+
+  std::vector<double> Latency;
+  Latency.reserve(Tuples*Repeat);
+  float First = 0;
+  auto Start = std::chrono::steady_clock::now();
+  for (int r = 0; r < Repeat; r++)
+    for (size_t t = 0; t < Tuples; t++) {
+      auto CallStart = std::chrono::steady_clock::now();
+      float Result;
+      Run(Args.data() + t*NumArgs,&Result,1);
+      Latency.push_back(std::chrono::duration<double,std::nano>(std::chrono::steady_clock::now() - CallStart).count());
+      if (r == 0 && t == 0)
+        First = Result;
+    }
+  double Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+
+  std::sort(Latency.begin(),Latency.end());
+  auto percentile = [&](double P) {
+    return Latency[std::min(Latency.size()-1,(size_t)(P*Latency.size()))];
+  };
+  fprintf(stdout,"%s(%s) = %f\n",Name.c_str(),NumArgs ? "first tuple" : "",First);
+  fprintf(stdout,"%zu calls in %.3f s: %.0f calls/sec\n",Latency.size(),Seconds,Latency.size()/Seconds);
+  fprintf(stdout,"latency (ns): min %.0f, p50 %.0f, p90 %.0f, p99 %.0f, max %.0f\n",
+          Latency.front(),percentile(0.5),percentile(0.9),percentile(0.99),Latency.back());
+
+  // All the tuples at once, transposed into the struct-of-arrays layout of the batch kernel
+  std::vector<float> Records(Tuples*NumArgs);
+  for (size_t t = 0; t < Tuples; t++)
+    for (unsigned e = 0; e < NumArgs; e++)
+      Records[e*Tuples + t] = Args[t*NumArgs + e];
+  std::vector<float> Results(Tuples);
+  Start = std::chrono::steady_clock::now();
+  for (int r = 0; r < Repeat; r++)
+    Run(Records.data(),Results.data(),Tuples);
+  Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+  fprintf(stdout,"batch of %zu records: %.0f records/sec\n",Tuples,Tuples*Repeat/Seconds);
+  return 0;
+}
 
 int
 main (int argc, char ** argv)
 {
-  if (argc < 3) {
-    fprintf(stdout,"Usage: %s filein.p1 fileout.bc\n",argv[0]);
+  // Options come before the input and output files
+  int argi = 1;
+  p1_options options;
+  bool scan_only = false;
+  bool batch = false;
+  batch_options Batch;
+  cache_options Cache;
+  bool run = false;
+  std::string ArgsFile;
+  int Repeat = 1;
+  codegen_options Codegen;
+  bool profile = false;
+  bool profile_json = false;
+  while (argi < argc && argv[argi][0] == '-' && strcmp(argv[argi],"--") != 0) {
+    std::string Option(argv[argi]);
+    // --option is the same as -option
+    if (Option.compare(0,2,"--") == 0)
+      Option.erase(0,1);
+    if (Option.compare(0,16,"-loop-threshold=") == 0)
+      options.loop_threshold = atoi(Option.c_str()+16);
+    else if (Option.compare(0,12,"-simd-width=") == 0) {
+      options.simd_width = atoi(Option.c_str()+12);
+      if (options.simd_width < 0 || (options.simd_width & (options.simd_width-1)) != 0) {
+        fprintf(stdout,"Vector width must be a power of two\n");
+        return 1;
+      }
+    }
+    else if (Option.compare(0,11,"-tile-size=") == 0)
+      options.tile_size = atoi(Option.c_str()+11);
+    else if (Option.compare(0,16,"-runtime-cutoff=") == 0)
+      options.runtime_cutoff = atoi(Option.c_str()+16);
+    else if (Option.size() == 3 && Option[1] == 'O' && Option[2] >= '0' && Option[2] <= '3')
+      Codegen.opt_level = Option[2] - '0';
+    else if (Option.compare(0,6,"-mcpu=") == 0)
+      Codegen.cpu = Option.substr(6);
+    else if (Option.compare(0,7,"-mattr=") == 0)
+      Codegen.attrs = Option.substr(7);
+    else if (Option.compare(0,10,"-filetype=") == 0) {
+      std::string Type = Option.substr(10);
+      Codegen.kind_set = true;
+      if (Type == "obj")
+        Codegen.kind = OUTPUT_OBJECT;
+      else if (Type == "asm")
+        Codegen.kind = OUTPUT_ASSEMBLY;
+      else if (Type == "bc")
+        Codegen.kind = OUTPUT_BITCODE;
+      else {
+        fprintf(stdout,"Unknown file type %s, use obj, asm or bc\n",Type.c_str());
+        return 1;
+      }
+    }
+    else if (Option == "-trace")
+      options.trace = true;
+    else if (Option == "-no-fold")
+      options.fold = false;
+    else if (Option == "-no-reuse")
+      options.value_numbering = false;
+    else if (Option == "-no-structure")
+      options.structure = false;
+    else if (Option == "-no-chain-order")
+      options.chain_order = false;
+    else if (Option == "-fast-math")
+      options.fast_math = true;
+    else if (Option == "-batch-kernel")
+      options.batch_kernel = true;
+    else if (Option == "-chain-stats")
+      options.chain_stats = true;
+    else if (Option == "-fold-stats")
+      options.fold_stats = true;
+    else if (Option == "-scan-only")
+      scan_only = true;
+    else if (Option == "-batch")
+      batch = true;
+    else if (Option.compare(0,6,"-jobs=") == 0)
+      Batch.jobs = std::max(1,atoi(Option.c_str()+6));
+    else if (Option.compare(0,9,"-out-dir=") == 0)
+      Batch.out_dir = Option.substr(9);
+    else if (Option.compare(0,6,"-link=") == 0)
+      Batch.link_file = Option.substr(6);
+    else if (Option.compare(0,11,"-cache-dir=") == 0)
+      Cache.dir = Option.substr(11);
+    else if (Option.compare(0,12,"-cache-size=") == 0)
+      Cache.max_bytes = std::max(1ll,atoll(Option.c_str()+12)) << 20;
+    else if (Option == "-cache-stats")
+      Cache.stats = true;
+    else if (Option == "-run")
+      run = true;
+    else if (Option.compare(0,5,"-run=") == 0) {
+      run = true;
+      ArgsFile = Option.substr(5);
+    }
+    else if (Option == "-profile")
+      profile = true;
+    else if (Option == "-profile=json")
+      profile = profile_json = true;
+    else if (Option.compare(0,8,"-repeat=") == 0)
+      Repeat = std::max(1,atoi(Option.c_str()+8));
+    else {
+      fprintf(stdout,"Unknown option %s\n",argv[argi]);
+      return 1;
+    }
+    argi++;
+  }
+
+  if (argc - argi < (scan_only || batch || run ? 1 : 2)) {
+    fprintf(stdout,"Usage: %s [options] filein.p1 fileout.bc|fileout.o|fileout.s\n",argv[0]);
     fprintf(stdout,"       or to read from stdin:\n");
-    fprintf(stdout,"       %s -- fileout.bc\n",argv[0]);
+    fprintf(stdout,"       %s [options] -- fileout.bc\n",argv[0]);
+    fprintf(stdout,"       or to measure the scanner:\n");
+    fprintf(stdout,"       %s -scan-only filein.p1\n",argv[0]);
+    fprintf(stdout,"       or to compile many files in parallel (directories and @lists of files are expanded):\n");
+    fprintf(stdout,"       %s [options] -batch [-jobs=N] [-out-dir=DIR | -link=fileout.bc] inputs...\n",argv[0]);
+    fprintf(stdout,"       or to JIT the function and time calls to it:\n");
+    fprintf(stdout,"       %s [options] -run[=args.txt] [-repeat=N] filein.p1\n",argv[0]);
+    fprintf(stdout,"Options:\n");
+    fprintf(stdout,"  -loop-threshold=N  generate loops for matrices with more than N elements (default %d)\n",options.loop_threshold);
+    fprintf(stdout,"  -simd-width=N      use <N x float> vectors in the generated loops, e.g. 4 or 8 (default scalar)\n");
+    fprintf(stdout,"  -tile-size=N       tile size of large matrix products, 0 disables tiling (default picked from the sizes)\n");
+    fprintf(stdout,"  -runtime-cutoff=N  call the libp1rt kernels (link p1rt.o) for matrices with N or more rows or columns (default 0, never)\n");
+    fprintf(stdout,"  -O0 to -O3         run the optimization pipeline of that level before writing, vectorizing from -O2 (default -O0)\n");
+    fprintf(stdout,"  -filetype=TYPE     write obj, asm or bc instead of picking the format from the output extension\n");
+    fprintf(stdout,"  -mcpu=CPU          generate code and tune the optimizations for CPU (default the host CPU)\n");
+    fprintf(stdout,"  -mattr=+a,-b       enable or disable target features, e.g. +avx2 (default the features of the host)\n");
+    fprintf(stdout,"  -trace             print the tokens, the parser trace and the generated module\n");
+    fprintf(stdout,"  -no-fold           emit every floating point operation, also on constants, zeros and ones\n");
+    fprintf(stdout,"  -no-reuse          emit repeated floating point operations again instead of reusing them\n");
+    fprintf(stdout,"  -fold-stats        report the floating point instructions folded away or reused and the FLOPs saved on zeros\n");
+    fprintf(stdout,"  -no-structure      with -fast-math, also multiply and add the structural zeros of sparse and identity matrices\n");
+    fprintf(stdout,"  -no-chain-order    multiply chains of matrix products in the order they are written\n");
+    fprintf(stdout,"  -fast-math         reassociate sums, use fused multiply-adds, skip structural zeros, set the fast-math flags\n");
+    fprintf(stdout,"  -batch-kernel      also generate name_batch(inputs, results, n) over n records in struct-of-arrays layout\n");
+    fprintf(stdout,"  -chain-stats       report the FLOPs of every chain of matrix products as written and reordered\n");
+    fprintf(stdout,"  -profile[=json]    report the time of the compile phases and counts per grammar rule, as text or JSON\n");
+    fprintf(stdout,"  -scan-only         only scan the input and report the number of tokens per second\n");
+    fprintf(stdout,"  -jobs=N            number of threads of the batch mode (default %u)\n",Batch.jobs);
+    fprintf(stdout,"  -out-dir=DIR       directory of the .bc files of the batch mode (default next to the inputs)\n");
+    fprintf(stdout,"  -link=FILE         link all the inputs of the batch mode into one module\n");
+    fprintf(stdout,"  -cache-dir=DIR     keep the compiled bitcode in DIR and reuse it for unchanged inputs and options\n");
+    fprintf(stdout,"  -cache-size=MB     evict the least recently used bitcode once the cache is larger (default %llu)\n",
+            (unsigned long long)(Cache.max_bytes >> 20));
+    fprintf(stdout,"  -cache-stats       report the hits and misses of the cache and its size\n");
+    fprintf(stdout,"  -run[=FILE]        call the function once per line of FILE (default stdin), a line holds the arguments\n");
+    fprintf(stdout,"                     (the elements of matrix arguments in row-major order)\n");
+    fprintf(stdout,"  -repeat=N          go over the argument lines of -run N times (default 1)\n");
     return 0;
   }
 
+  // Scanner benchmark, the tokens are read without parsing them
+  if (scan_only) {
+    auto start = std::chrono::steady_clock::now();
+    long tokens = scanP1File(argv[argi],options);
+    std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+    if (tokens < 0) {
+      fprintf(stdout,"Can't read %s\n",argv[argi]);
+      return 1;
+    }
+    fprintf(stdout,"%ld tokens in %.3f s, %.0f tokens/sec\n",tokens,seconds.count(),tokens/seconds.count());
+    return 0;
+  }
+
+  // The optimization pipeline and the code generator need the host target
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+
+  // Reports of the compilation need it to run, so they bypass the cache
+  if (options.trace || options.fold_stats || options.chain_stats || profile)
+    Cache.dir.clear();
+  if (!Cache.dir.empty() && sys::fs::create_directories(Cache.dir)) {
+    fprintf(stdout,"Can't create the cache directory %s\n",Cache.dir.c_str());
+    return 1;
+  }
+
+  // Batch mode, the remaining arguments are inputs
+  if (batch) {
+    std::vector<std::string> Inputs;
+    for (; argi < argc; argi++)
+      if (!collectInputs(argv[argi],Inputs))
+        return 1;
+    return compileBatch(Inputs,Batch,Cache,Codegen,options);
+  }
+
+  // Run mode, the module is compiled with the JIT instead of written out
+  if (run) {
+    auto Context = std::make_unique<LLVMContext>();
+    options.batch_kernel = true;
+    unique_ptr<Module> M = parseP1File(argv[argi],*Context,options);
+    if (M.get() == nullptr) {
+      std::cout << "Errors. No module produced." << std::endl;
+      return 1;
+    }
+    // The JIT generates code for the host, -mcpu and -mattr only tune the optimizations
+    std::unique_ptr<TargetMachine> TM = Codegen.opt_level > 0 ? createTargetMachine(Codegen) : nullptr;
+    if (Codegen.opt_level > 0 && !TM)
+      return 1;
+    optimizeModule(*M,Codegen.opt_level,TM.get());
+    return runModule(std::move(M),std::move(Context),ArgsFile,Repeat);
+  }
+
   // Remember command line strings
-  std::string InputFilename(argv[1]);
-  std::string OutputFilename(argv[2]);
+  std::string InputFilename(argv[argi]);
+  std::string OutputFilename(argv[argi+1]);
+  output_kind Kind = outputKind(Codegen,OutputFilename);
+  std::unique_ptr<TargetMachine> TM;
+  if (needsTarget(Codegen,Kind)) {
+    TM = createTargetMachine(Codegen);
+    if (!TM)
+      return 1;
+  }
+
+  // A hit in the cache gives the output without parsing
+  std::string Entry;
+  if (!Cache.dir.empty() && InputFilename != "--") {
+    Entry = cacheEntry(Cache,InputFilename,options,targetKey(Codegen,Kind,TM.get()));
+    if (!Entry.empty() && fetchCached(Entry,OutputFilename)) {
+      if (Cache.stats)
+        reportCache(Cache,1,0);
+      return 0;
+    }
+  }
 
   // Make an output file
+  removeOutput(OutputFilename);
   std::unique_ptr<ToolOutputFile> Out;  
   std::string ErrorInfo;
   std::error_code EC;
   Out.reset(new ToolOutputFile(OutputFilename.c_str(), EC,
-			       sys::fs::OF_None));
+			       Kind == OUTPUT_ASSEMBLY ? sys::fs::OF_Text : sys::fs::OF_None));
 
-  // Do the work
-  unique_ptr<Module> M = parseP1File(InputFilename);
+  // Do the work, in a context of its own
+  auto Start = std::chrono::steady_clock::now();
+  LLVMContext Context;
+  p1_profile Profile;
+  unique_ptr<Module> M = parseP1File(InputFilename,Context,options,profile ? &Profile : nullptr);
 
-  // If successful, produce LLVM bitcode
+  // If successful, produce LLVM bitcode or native code
   if (M.get() != nullptr) // if we get a valid module back
     {
-      // Write the bitcode file out.
-      WriteBitcodeToFile(*M.get(),Out->os());    
+      // Optimize in process, no opt run over the written bitcode is needed
+      auto OptimizeStart = std::chrono::steady_clock::now();
+      optimizeModule(*M,Codegen.opt_level,TM.get());
+      size_t ModuleInstructions = profile ? countInstructions(*M) : 0;
+      // Write the output file out, native code without a separate llc run.
+      auto WriteStart = std::chrono::steady_clock::now();
+      if (Entry.empty()) {
+        if (!writeModule(*M,TM.get(),Kind,Out->os()))
+          return 1;
+      } else {
+        SmallVector<char,0> Output;
+        raw_svector_ostream OS(Output);
+        if (!writeModule(*M,TM.get(),Kind,OS))
+          return 1;
+        Out->os() << OS.str();
+        storeCached(Cache,Entry,OS.str());
+        evictCached(Cache);
+        if (Cache.stats)
+          reportCache(Cache,0,1);
+      }
       // Keep the output file.
       Out->keep();
+      if (profile) {
+        auto End = std::chrono::steady_clock::now();
+        printProfile(Profile,std::chrono::duration<double>(WriteStart - OptimizeStart).count(),
+                     std::chrono::duration<double>(End - WriteStart).count(),
+                     std::chrono::duration<double>(End - Start).count(),ModuleInstructions,peakRSS(),profile_json);
+      }
     }
   else
     {
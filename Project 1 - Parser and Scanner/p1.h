@@ -0,0 +1,86 @@
+#ifndef P1_H
+#define P1_H
+
+#include <map>
+#include <memory>
+#include <string>
+
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+
+//Options of a compilation, set by the driver.
+struct p1_options
+{
+  //Matrices with more elements than this are stored in arrays and generated with loops.
+  int loop_threshold = 64;
+  //Number of float lanes in the vectors used for loops over matrices in storage, 0 or 1 for scalar code.
+  int simd_width = 0;
+  //Tile size of the blocked matrix product. 0 disables tiling and -1 picks it from the operand dimensions.
+  int tile_size = -1;
+  //Products, determinants, inverses, transposes and reductions of matrices with at least this many rows or columns call
+  //the kernels of libp1rt (p1rt.h) instead of being generated inline, so the output has to be linked with p1rt.o. 0
+  //generates all the code inline.
+  int runtime_cutoff = 0;
+  //Prints the tokens, the parser trace and the generated module.
+  bool trace = false;
+  //Folds constant operations and the exact identities like x*1 while generating the code, x+0 and x*0 with fast_math.
+  bool fold = true;
+  //Reuses the floating point instructions already emitted for the same operation and operands.
+  bool value_numbering = true;
+  //Reports how many instructions the folding and the value numbering saved.
+  bool fold_stats = false;
+  //Multiplies chains of matrix products in the order with the fewest floating point operations.
+  bool chain_order = true;
+  //Reports the floating point operations of every chain of matrix products as written and reordered.
+  bool chain_stats = false;
+  //Allows reassociating floating point operations: sums are added as trees with several accumulators, products are
+  //accumulated with llvm.fmuladd and all the floating point instructions get the fast-math flags.
+  bool fast_math = false;
+  //Tracks the elements of the matrices which are structurally zero, so products, reductions and determinants skip them
+  //and products with identity matrices are left out. Needs fold and fast_math, skipping x*0 and x+0 changes the
+  //results of infinities, NaNs and signed zeros.
+  bool structure = true;
+  //Also generates <name>_batch, which evaluates the function over many records in struct-of-arrays layout.
+  bool batch_kernel = false;
+};
+
+//Compile-time profile of one grammar rule.
+struct p1_rule_profile
+{
+  long reductions = 0;
+  //Instructions generated by the action of the rule.
+  long instructions = 0;
+  double seconds = 0;
+};
+
+//Compile-time profile of a compilation.
+struct p1_profile
+{
+  //Time in the scanner.
+  double scan_seconds = 0;
+  //Time in the parser tables, between the tokens and the actions.
+  double parse_seconds = 0;
+  //Time in the actions of the rules, which build the IR.
+  double ir_seconds = 0;
+  //Time printing the module when tracing.
+  double print_seconds = 0;
+  long tokens = 0;
+  long reductions = 0;
+  long instructions = 0;
+  //Size of the symbol table and the matrix table at the end, they only grow.
+  size_t symbols = 0;
+  size_t matrices = 0;
+  //Profile of every grammar rule, by the text of the rule.
+  std::map<std::string,p1_rule_profile> rules;
+};
+
+//Compiles a p1 file ("--" for stdin) into a new module of the given LLVMContext, returns NULL on errors. All the state
+//of the compilation is local to the call, so files can be compiled concurrently from several threads as long as every
+//thread uses its own LLVMContext. Fills in profile when it is given.
+std::unique_ptr<llvm::Module> parseP1File(const std::string &InputFilename,llvm::LLVMContext &Context,const p1_options &options,
+                                          p1_profile *profile = nullptr);
+
+//Runs only the scanner over a p1 file. Returns the number of tokens, -1 if the file can't be read.
+long scanP1File(const std::string &InputFilename,const p1_options &options);
+
+#endif
@@ -2,12 +2,17 @@
 #include <cstdio>
 #include <list>
 #include <vector>
+#include <deque>
 #include <map>
+#include <unordered_map>
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <memory>
 #include <stdexcept>
+#include <functional>
+#include <tuple>
+#include <chrono>
 
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Value.h"
@@ -20,179 +25,1930 @@
 #include "llvm/Support/SystemUtils.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/PatternMatch.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Allocator.h"
+
+#include "p1.h"
 
 using namespace llvm;
 using namespace std;
 
 
-// Need for parser and scanner
-extern FILE *yyin;
-int yylex();
-void yyerror(const char*);
-int yyparse();
- 
-// Needed for LLVM
-string funName;
-Module *M;
-LLVMContext TheContext;
-IRBuilder<> Builder(TheContext);
-
-//Map to store the variables and values
-static std::map<std::string, Value*> Variable_mappings;
-//Map to find out whether the variable is a matrix or a value. True means matrix and False means variable.
-std::map<std::string,bool> mat_or_val;
-//Vector to store the arguments variable names.
-std::vector<std::string> args_vec;
-//Map of 2D vectors to store the matrix name and values.
-std::map<std::string,std::vector<std::vector<Value*>>> matrices;
-//Storing the dimension of the matrix.
-int dimensions[2];
-
-//Type definition of 2D vector to pass the matrix to upper level rules of grammar.
-typedef std::vector<std::vector<Value*>*> rows2d;
-//Type definition of 1D vector to pass the matrix to upper level rules of grammar.
-typedef std::vector<Value*> rows;
+// Need for parser and scanner
+typedef void* yyscan_t;
+struct scan_input;
+scan_input* scan_file(yyscan_t scanner,const char* filename,bool trace);
+void end_scan(yyscan_t scanner,scan_input* input);
+int yylex_init_extra(struct p1_context* extra,yyscan_t* scanner);
+int yylex_destroy(yyscan_t scanner);
+void yyerror(const char*);
+
+//Matrix entity. Small matrices are fully unrolled into one Value* per element. Matrices with more than
+//loop_threshold elements live in a row-major float array (storage) and are generated with loops.
+struct matrix
+{
+  int rows=0;
+  int cols=0;
+  //Unrolled element values in row-major order, empty if not unrolled. Also used as a cache of loaded elements
+  //for matrices kept in storage.
+  std::vector<Value*> elements;
+  //Pointer to the row-major float array holding the matrix, NULL if the matrix is only unrolled.
+  Value* storage=NULL;
+  //Only the columns row_start[i] to row_end[i]-1 of row i may not be zero, the other elements are structural zeros.
+  //Empty until find_structure fills them in.
+  std::vector<int> row_start;
+  std::vector<int> row_end;
+  //Row i of the unrolled elements, so element [i][j] is m[i][j].
+  Value** operator[](int i)
+  {
+    return &elements[i*cols];
+  }
+};
+
+//Arrays bigger than this many bytes are allocated on the heap instead of the stack.
+const int stack_storage_limit = 16384;
+//Bytes of data cache the tiles of a blocked matrix product are sized for when the tile size is picked automatically.
+const int tile_cache_bytes = 32768;
+//Accumulators of the unrolled inner products in fast-math mode.
+const int product_accumulators = 4;
+
+//Creates an unrolled rows x cols matrix entity, the elements are filled in by the caller.
+matrix make_matrix(int rows,int cols)
+{
+  matrix m;
+  m.rows = rows;
+  m.cols = cols;
+  m.elements.resize(rows*cols);
+  return m;
+}
+
+//LU decomposition with partial pivoting (P A = L U) of an n x n matrix. lu holds the unit lower triangular L below the
+//diagonal and U on and above it, perm holds the original row of every row and sign the sign of the permutation.
+struct lu_factors
+{
+  int n=0;
+  Value* lu=NULL;
+  Value* perm=NULL;
+  Value* sign=NULL;
+};
+
+//Kinds of nodes of a matrix expression. MAT_SCALE and MAT_DIVIDE combine a matrix with a scalar, MAT_PRODUCT is
+//the matrix product of left and right.
+enum mat_expr_kind { MAT_LEAF, MAT_ADD, MAT_SUB, MAT_SCALE, MAT_DIVIDE, MAT_NEGATE, MAT_PRODUCT };
+
+//Lazy matrix expression. The elementwise operations are only recorded while parsing and evaluated in one fused
+//pass over the elements, so no temporary matrix is generated for the intermediate results. Leaves hold the handle
+//of a matrix which is already evaluated, either a named matrix or the result of a non elementwise operation.
+//Matrix products are recorded too, so a chain of products is multiplied in the cheapest order.
+struct mat_expr
+{
+  mat_expr_kind kind=MAT_LEAF;
+  int rows=0;
+  int cols=0;
+  int value=-1;
+  mat_expr *left=NULL;
+  mat_expr *right=NULL;
+  Value* scalar=NULL;
+};
+
+//State of one compilation. Every call of parseP1File has its own context and LLVMContext, so several files can be
+//compiled at the same time from different threads. The code generation helpers are members of the context.
+struct p1_context
+{
+  // Needed for LLVM
+  string funName;
+  Module *M=NULL;
+  LLVMContext &TheContext;
+  //Every instruction the Builder inserts is counted for the profile.
+  IRBuilder<ConstantFolder,IRBuilderCallbackInserter> Builder;
+
+  //Interned identifiers. The scanner turns every identifier into a dense symbol number and the symbol tables below
+  //are vectors indexed by it.
+  std::vector<std::string> symbol_names;
+  std::unordered_map<std::string,int> symbol_numbers;
+  //Values of the variables, indexed by symbol.
+  std::vector<Value*> Variable_mappings;
+  //Whether the symbol is a matrix or a value. True means matrix and False means variable.
+  std::vector<bool> mat_or_val;
+  //Vector to store the symbols of the argument names.
+  std::vector<int> args_vec;
+  //Dimensions of the matrix arguments, 0 x 0 for float arguments.
+  std::vector<std::pair<int,int>> args_dims;
+
+  //All the matrices of the function, referenced by their index (handle). A deque keeps references to the matrices
+  //valid while new ones are added.
+  std::deque<matrix> matrix_table;
+  //Handle of the matrix of every symbol, -1 if the symbol is not a matrix. Assigning a matrix only rebinds the handle.
+  std::vector<int> matrices;
+  //Storing the dimension of the matrix.
+  int dimensions[2];
+  //Heap allocated arrays which are freed before the function returns.
+  std::vector<Value*> heap_storage;
+
+  //Options of the compilation, see p1_options.
+  int loop_threshold;
+  int simd_width;
+  int tile_size;
+  int runtime_cutoff;
+  bool trace_parser;
+  bool fold;
+  bool value_numbering;
+  bool chain_order;
+  bool chain_stats;
+  bool fast_math;
+  bool batch_kernel;
+  bool structure;
+
+  //Compile-time profile, NULL unless the compilation is profiled. The time since the last event is charged to what
+  //was running: the scanner, the parser tables or the action of the rule which was reduced last (including the
+  //code it generates, also for the lazy matrix expressions it evaluates).
+  p1_profile *profile=NULL;
+  enum profile_phase { PHASE_SCAN, PHASE_PARSE, PHASE_RULE };
+  profile_phase phase=PHASE_PARSE;
+  std::chrono::steady_clock::time_point checkpoint;
+  std::map<const char*,p1_rule_profile> rule_profiles;
+  p1_rule_profile *current_rule=NULL;
+  //Number of floating point instructions which were folded away instead of emitted.
+  long folded_ops=0;
+  //Floating point instructions already emitted, by opcode, operands and block. A repeated operation in the same block
+  //returns the existing instruction, which dominates it.
+  std::map<std::tuple<unsigned,Value*,Value*,BasicBlock*>,Value*> value_numbers;
+  //Number of floating point instructions which were reused instead of emitted again.
+  long reused_ops=0;
+  //Floating point operations the structural zeros and identity matrices saved, counted once per generated operation
+  //for unrolled code and once per iteration for loops.
+  long structural_flops=0;
+  //Bump arena of the semantic values of the parser and the matrix expressions, released in one go with the context.
+  BumpPtrAllocator arena;
+
+  p1_context(LLVMContext &Context,const p1_options &options)
+    : TheContext(Context), Builder(Context,ConstantFolder(),IRBuilderCallbackInserter([this](Instruction*) { inserted(); })),
+      loop_threshold(options.loop_threshold), simd_width(options.simd_width),
+      tile_size(options.tile_size), runtime_cutoff(options.runtime_cutoff), trace_parser(options.trace),
+      fold(options.fold), value_numbering(options.value_numbering), chain_order(options.chain_order),
+      chain_stats(options.chain_stats), fast_math(options.fast_math), batch_kernel(options.batch_kernel), structure(options.structure && options.fold && options.fast_math)
+  {
+    //All the floating point instructions of the Builder get the fast-math flags.
+    if(fast_math)
+    {
+      FastMathFlags flags;
+      flags.setFast();
+      Builder.setFastMathFlags(flags);
+    }
+  }
+
+  //Creates a semantic value in the arena. Destructors don't run, so the values only hold memory of the arena.
+  template<typename T,typename... Args> T* make(Args&&... args)
+  {
+    return new (arena.Allocate<T>()) T(std::forward<Args>(args)...);
+  }
+  int intern(const char* name);
+  void bind_arguments(Function *F);
+  void start_phase(profile_phase next);
+  void enter_rule(const char* rule);
+  void reduced(const char* rule);
+  void inserted();
+  void add_batch_kernel(Function *F);
+  Value* folded(Value* v);
+  Value* numbered(unsigned opcode,Value* x,Value* y,std::function<Value*()> emit);
+  Value* fadd(Value* x,Value* y);
+  Value* fsub(Value* x,Value* y);
+  Value* fmul(Value* x,Value* y);
+  Value* fdiv(Value* x,Value* y);
+  Value* fneg(Value* x);
+  Value* fmuladd(Value* x,Value* y,Value* z);
+  Value* fmulsub(Value* x,Value* y,Value* z);
+  Value* sum_terms(const std::vector<Value*> &terms);
+  int new_matrix(matrix m);
+  Value* allocate_storage(int rows,int cols);
+  void free_heap_storage();
+  Value* flat_index(Value* row,Value* col,int cols);
+  Value* element_ptr(Value* storage,Value* row,Value* col,int cols);
+  Value* load_element(const matrix &m,Value* row,Value* col);
+  Value* emit_loop(int count,Value* init,std::function<Value*(Value*,Value*)> body);
+  Value* emit_range_loop(Value* start,Value* end,Value* init,std::function<Value*(Value*,Value*)> body);
+  void to_storage(matrix &m);
+  matrix& unrolled(matrix &m);
+  bool use_loops(const matrix &a,const matrix &b,int rows,int cols);
+  bool use_runtime(int size);
+  Value* call_runtime(const char* name,Type* result,std::vector<Value*> args);
+  void find_structure(matrix &m);
+  bool is_dense(matrix &m);
+  bool is_identity(matrix &m);
+  bool is_triangular(matrix &m);
+  Value* row_table(const std::vector<int> &values);
+  Value* load_row(Value* table,Value* i);
+  Value* load_lanes(Value* storage,Value* index,int width);
+  void store_lanes(Value* value,Value* storage,Value* index);
+  Value* splat(Value* scalar,int width);
+  void emit_lanes(int count,std::function<void(Value*,int)> body);
+  void emit_range_lanes(Value* start,Value* end,std::function<void(Value*,int)> body);
+  std::vector<Value*> transpose_lanes(std::vector<Value*> block);
+  matrix transpose_loop(matrix &a);
+  int product_tile(int rows,int inner,int cols);
+  Value* tile_end(Value* start,int tile,int size);
+  void tiled_product_loop(const matrix &a,const matrix &b,const matrix &result,int tile);
+  matrix product_loop(matrix &a,matrix &b);
+  long banded_ranges(matrix &a,matrix &b,std::vector<int> &row_start,std::vector<int> &row_end);
+  matrix banded_product_loop(matrix &a,matrix &b);
+  matrix runtime_product(matrix &a,matrix &b);
+  lu_factors lu_decompose(matrix &a,bool transposed);
+  Value* lu_determinant(const lu_factors &f);
+  Value* triangular_determinant(matrix &m);
+  void lu_solve(const lu_factors &f,int columns,std::function<Value*(Value*,Value*)> rhs,Value* result,bool transposed);
+  matrix inverse_loop(matrix &a);
+  matrix divide_loop(matrix &a,matrix &b);
+  mat_expr* leaf_expr(int handle);
+  mat_expr* result_expr(matrix m);
+  mat_expr* elementwise_expr(mat_expr_kind kind,mat_expr *left,mat_expr *right,Value* scalar);
+  mat_expr* product_expr(mat_expr *left,mat_expr *right);
+  void expr_leaves(mat_expr *e,std::vector<matrix*> &leaves);
+  Value* combine(mat_expr *e,Value* x,Value* y);
+  Value* element_value(mat_expr *e,int i,int j);
+  Value* lanes_value(mat_expr *e,Value* index,int width);
+  bool expr_uses_loops(mat_expr *e,std::vector<matrix*> &leaves);
+  void expr_structure(mat_expr *e,std::vector<int> &start,std::vector<int> &end);
+  matrix& evaluate(mat_expr *e);
+  void evaluate_products(mat_expr *e);
+  void evaluate_chain(mat_expr *e);
+  Value* reduction(mat_expr *e);
+  matrix matrix_product(matrix &a_mat,matrix &b_mat);
+  Value* find_determinant(matrix &mat);
+};
+
+//Returns the symbol number of an identifier, adding it to the symbol tables the first time it is seen.
+int p1_context::intern(const char* name)
+{
+  auto found = symbol_numbers.find(name);
+  if(found != symbol_numbers.end())
+    return found->second;
+  int symbol = symbol_names.size();
+  symbol_names.push_back(name);
+  symbol_numbers[symbol_names.back()] = symbol;
+  Variable_mappings.push_back(NULL);
+  mat_or_val.push_back(false);
+  matrices.push_back(-1);
+  return symbol;
+}
+
+//Charges the time since the last event to the running phase and starts the next one.
+void p1_context::start_phase(profile_phase next)
+{
+  auto now = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration<double>(now - checkpoint).count();
+  if(phase == PHASE_SCAN)
+    profile->scan_seconds += seconds;
+  else if(phase == PHASE_PARSE)
+    profile->parse_seconds += seconds;
+  else
+  {
+    profile->ir_seconds += seconds;
+    current_rule->seconds += seconds;
+  }
+  checkpoint = now;
+  phase = next;
+}
+
+//Charges the time and the instructions from now on to a rule.
+void p1_context::enter_rule(const char* rule)
+{
+  start_phase(PHASE_RULE);
+  current_rule = &rule_profiles[rule];
+}
+
+//Called at the start of the action of every grammar rule with the text of the rule.
+void p1_context::reduced(const char* rule)
+{
+  if(profile == NULL)
+    return;
+  enter_rule(rule);
+  current_rule->reductions++;
+  profile->reductions++;
+}
+
+//Called for every instruction inserted by the Builder.
+void p1_context::inserted()
+{
+  if(profile == NULL)
+    return;
+  profile->instructions++;
+  if(current_rule != NULL)
+    current_rule->instructions++;
+}
+
+//Maps the arguments of the function to the parameters. A float parameter is one float argument. A matrix parameter
+//m [rows x cols] is passed as a pointer to its elements in row-major order followed by its number of rows and columns,
+//which are checked against the declared dimensions on entry, the function returns NaN if they don't match. Small
+//matrices are loaded into unrolled elements, bigger ones are used in place. Leaves the Builder in the body.
+void p1_context::bind_arguments(Function *F)
+{
+  BasicBlock *entry = BasicBlock::Create(TheContext,"entry",F);
+  Builder.SetInsertPoint(entry);
+  Value* dims_ok = NULL;
+  std::vector<Value*> pointers;
+  auto arg = F->arg_begin();
+  for(size_t p=0;p<args_vec.size();p++)
+  {
+    int rows = args_dims[p].first;
+    int cols = args_dims[p].second;
+    if(rows == 0)
+    {
+      Variable_mappings[args_vec[p]] = &*arg++;
+      pointers.push_back(NULL);
+      continue;
+    }
+    Value* elements = &*arg++;
+    Value* rows_arg = &*arg++;
+    Value* cols_arg = &*arg++;
+    elements->setName(symbol_names[args_vec[p]]);
+    Value* ok = Builder.CreateAnd(Builder.CreateICmpEQ(rows_arg,Builder.getInt32(rows)),
+                                  Builder.CreateICmpEQ(cols_arg,Builder.getInt32(cols)));
+    dims_ok = dims_ok == NULL ? ok : Builder.CreateAnd(dims_ok,ok);
+    pointers.push_back(elements);
+  }
+  if(dims_ok == NULL)
+    return;
+
+  BasicBlock *body = BasicBlock::Create(TheContext,"body",F);
+  BasicBlock *bad_dims = BasicBlock::Create(TheContext,"bad.dims",F);
+  Builder.CreateCondBr(dims_ok,body,bad_dims);
+  Builder.SetInsertPoint(bad_dims);
+  Builder.CreateRet(ConstantFP::getNaN(Builder.getFloatTy()));
+  Builder.SetInsertPoint(body);
+  for(size_t p=0;p<args_vec.size();p++)
+  {
+    if(pointers[p] == NULL)
+      continue;
+    matrix m;
+    m.rows = args_dims[p].first;
+    m.cols = args_dims[p].second;
+    m.storage = pointers[p];
+    if(m.rows*m.cols <= loop_threshold)
+    {
+      unrolled(m);
+      m.storage = NULL;
+    }
+    matrices[args_vec[p]] = new_matrix(std::move(m));
+    mat_or_val[args_vec[p]] = true;
+  }
+}
+
+//Adds void <name>_batch(const float* inputs,float* results,int n), which evaluates the function over n records, and
+//the constant int <name>_inputs, the number of floats of a record: the float arguments and the elements of the matrix
+//arguments in row-major order. The inputs are in struct-of-arrays layout, float e of record r is inputs[e*n+r], so
+//every iteration of the loop over the records loads from consecutive addresses. The iterations are independent and the
+//function is marked always inline, so the loop calls it inline, also at -O0 where p1 only runs the AlwaysInliner, and
+//the optimizer can vectorize the loop across records.
+void p1_context::add_batch_kernel(Function *F)
+{
+  int width = 0;
+  for(auto dims: args_dims)
+  {
+    width += dims.first == 0 ? 1 : dims.first*dims.second;
+  }
+  new GlobalVariable(*M,Builder.getInt32Ty(),true,GlobalValue::ExternalLinkage,Builder.getInt32(width),
+                     funName + "_inputs");
+
+  Type *float_ptr = PointerType::getUnqual(Builder.getFloatTy());
+  FunctionType *BatchType = FunctionType::get(Builder.getVoidTy(),{float_ptr,float_ptr,Builder.getInt32Ty()},false);
+  Function *Batch = Function::Create(BatchType,GlobalValue::ExternalLinkage,funName + "_batch",M);
+  F->addFnAttr(Attribute::AlwaysInline);
+  Value* inputs = Batch->getArg(0);
+  Value* results = Batch->getArg(1);
+  Value* n = Batch->getArg(2);
+  Builder.SetInsertPoint(BasicBlock::Create(TheContext,"entry",Batch));
+
+  //The matrix arguments of a record are gathered into arrays allocated once.
+  std::vector<Value*> buffers;
+  for(auto dims: args_dims)
+  {
+    buffers.push_back(dims.first == 0 ? NULL : allocate_storage(dims.first,dims.second));
+  }
+
+  //Address of float e of record r.
+  auto input_ptr = [&](Value* e,Value* r) {
+    return Builder.CreateGEP(Builder.getFloatTy(),inputs,Builder.CreateAdd(Builder.CreateMul(e,n),r));
+  };
+  emit_range_loop(Builder.getInt32(0),n,NULL,[&](Value* r,Value*) -> Value* {
+    std::vector<Value*> call_args;
+    int e = 0;
+    for(size_t p=0;p<args_dims.size();p++)
+    {
+      int rows = args_dims[p].first;
+      int cols = args_dims[p].second;
+      if(rows == 0)
+      {
+        call_args.push_back(Builder.CreateLoad(Builder.getFloatTy(),input_ptr(Builder.getInt32(e),r)));
+        e++;
+        continue;
+      }
+      if(rows*cols <= loop_threshold)
+      {
+        for(int k=0;k<rows*cols;k++)
+        {
+          Value* x = Builder.CreateLoad(Builder.getFloatTy(),input_ptr(Builder.getInt32(e+k),r));
+          Builder.CreateStore(x,Builder.CreateGEP(Builder.getFloatTy(),buffers[p],Builder.getInt32(k)));
+        }
+      }
+      else
+      {
+        emit_loop(rows*cols,NULL,[&](Value* k,Value*) -> Value* {
+          Value* x = Builder.CreateLoad(Builder.getFloatTy(),input_ptr(Builder.CreateAdd(k,Builder.getInt32(e)),r));
+          Builder.CreateStore(x,Builder.CreateGEP(Builder.getFloatTy(),buffers[p],k));
+          return NULL;
+        });
+      }
+      call_args.push_back(buffers[p]);
+      call_args.push_back(Builder.getInt32(rows));
+      call_args.push_back(Builder.getInt32(cols));
+      e += rows*cols;
+    }
+    CallInst *call = Builder.CreateCall(F,call_args);
+    Builder.CreateStore(call,Builder.CreateGEP(Builder.getFloatTy(),results,r));
+    return NULL;
+  });
+  free_heap_storage();
+  Builder.CreateRetVoid();
+}
+
+//Symbol number of an identifier for the scanner.
+int intern(p1_context *ctx,const char* name)
+{
+  return ctx->intern(name);
+}
+
+//Tells the scanner if the tokens are printed.
+bool tracing(p1_context *ctx)
+{
+  return ctx->trace_parser;
+}
+
+//Floating point arithmetic of the code generation. Operations on constants are folded and the exact identities x+(-0),
+//x-(+0), x*1, x/1 and -(-x) give x back, (-0)-x gives -x. With -fast-math, which assumes no signed zeros, infinities or
+//NaNs, x+0 and x-0 give x for either zero and x*0 gives 0, so the zeros of partly constant matrices propagate through
+//whole matrix operations. The operands can be floats or vectors of floats, a splat constant counts as a constant. The
+//-no-fold option emits every operation. The remaining operations are hash-consed, see numbered.
+Value* p1_context::folded(Value* v)
+{
+  folded_ops++;
+  return v;
+}
+
+//Returns the instruction computing opcode over x and y (NULL for unary operations) if it was already emitted in the
+//current block, otherwise emits it. The operands of the commutative fadd and fmul are ordered, so a+b and b+a are the
+//same instruction. This keeps the shared minors of the determinants and inverses and the repeated subexpressions of
+//the program from being emitted more than once. The -no-reuse option emits every operation.
+Value* p1_context::numbered(unsigned opcode,Value* x,Value* y,std::function<Value*()> emit)
+{
+  if(!value_numbering)
+    return emit();
+  if((opcode == Instruction::FAdd || opcode == Instruction::FMul) && y < x)
+    std::swap(x,y);
+  auto key = std::make_tuple(opcode,x,y,Builder.GetInsertBlock());
+  auto found = value_numbers.find(key);
+  if(found != value_numbers.end())
+  {
+    reused_ops++;
+    return found->second;
+  }
+  Value* v = emit();
+  value_numbers[key] = v;
+  return v;
+}
+
+Value* p1_context::fadd(Value* x,Value* y)
+{
+  using namespace PatternMatch;
+  if(fold)
+  {
+    if(fast_math ? match(y,m_AnyZeroFP()) : match(y,m_NegZeroFP()))
+      return folded(x);
+    if(fast_math ? match(x,m_AnyZeroFP()) : match(x,m_NegZeroFP()))
+      return folded(y);
+    if(isa<Constant>(x) && isa<Constant>(y))
+      return folded(Builder.CreateFAdd(x,y));
+  }
+  return numbered(Instruction::FAdd,x,y,[&]() { return Builder.CreateFAdd(x,y); });
+}
+
+Value* p1_context::fsub(Value* x,Value* y)
+{
+  using namespace PatternMatch;
+  if(fold)
+  {
+    if(fast_math ? match(y,m_AnyZeroFP()) : match(y,m_PosZeroFP()))
+      return folded(x);
+    if(isa<Constant>(x) && isa<Constant>(y))
+      return folded(Builder.CreateFSub(x,y));
+    if(fast_math ? match(x,m_AnyZeroFP()) : match(x,m_NegZeroFP()))
+      return fneg(y);
+  }
+  return numbered(Instruction::FSub,x,y,[&]() { return Builder.CreateFSub(x,y); });
+}
+
+Value* p1_context::fmul(Value* x,Value* y)
+{
+  using namespace PatternMatch;
+  if(fold)
+  {
+    if(fast_math && match(y,m_AnyZeroFP()))
+      return folded(y);
+    if(fast_math && match(x,m_AnyZeroFP()))
+      return folded(x);
+    if(match(y,m_FPOne()))
+      return folded(x);
+    if(match(x,m_FPOne()))
+      return folded(y);
+    if(isa<Constant>(x) && isa<Constant>(y))
+      return folded(Builder.CreateFMul(x,y));
+  }
+  return numbered(Instruction::FMul,x,y,[&]() { return Builder.CreateFMul(x,y); });
+}
+
+Value* p1_context::fdiv(Value* x,Value* y)
+{
+  using namespace PatternMatch;
+  if(fold)
+  {
+    if(match(y,m_FPOne()))
+      return folded(x);
+    if(isa<Constant>(x) && isa<Constant>(y))
+      return folded(Builder.CreateFDiv(x,y));
+  }
+  return numbered(Instruction::FDiv,x,y,[&]() { return Builder.CreateFDiv(x,y); });
+}
+
+Value* p1_context::fneg(Value* x)
+{
+  using namespace PatternMatch;
+  Value* inner;
+  if(fold)
+  {
+    if(match(x,m_FNeg(m_Value(inner))))
+      return folded(inner);
+    if(isa<Constant>(x))
+      return folded(Builder.CreateFNeg(x));
+  }
+  return numbered(Instruction::FNeg,x,NULL,[&]() { return Builder.CreateFNeg(x); });
+}
+
+//Multiply-accumulate x*y+z. In fast-math mode it is the llvm.fmuladd intrinsic, which becomes a fused multiply-add
+//where the target has one, otherwise it is z+x*y as two instructions. Products with constants are left to fmul and
+//fadd so they are folded.
+Value* p1_context::fmuladd(Value* x,Value* y,Value* z)
+{
+  if(!fast_math || (fold && (isa<Constant>(x) || isa<Constant>(y) || isa<Constant>(z))))
+    return fadd(z,fmul(x,y));
+  return Builder.CreateIntrinsic(Intrinsic::fmuladd,{x->getType()},{x,y,z});
+}
+
+//Multiply-subtract z-x*y, see fmuladd.
+Value* p1_context::fmulsub(Value* x,Value* y,Value* z)
+{
+  if(!fast_math || (fold && (isa<Constant>(x) || isa<Constant>(y) || isa<Constant>(z))))
+    return fsub(z,fmul(x,y));
+  return fmuladd(fneg(x),y,z);
+}
+
+//Sums the terms. In fast-math mode they are added pairwise as a balanced tree, so the critical path has log2 of the
+//number of terms additions instead of one per term. Otherwise they are added one after the other from 0.
+Value* p1_context::sum_terms(const std::vector<Value*> &terms)
+{
+  Value* zero = ConstantFP::get(Type::getFloatTy(TheContext), 0.0);
+  if(!fast_math || terms.empty())
+  {
+    Value* sum = zero;
+    for(auto t: terms)
+    {
+      sum = fadd(sum,t);
+    }
+    return sum;
+  }
+  std::vector<Value*> level = terms;
+  while(level.size() > 1)
+  {
+    std::vector<Value*> next;
+    for(size_t i=0;i+1<level.size();i+=2)
+    {
+      next.push_back(fadd(level[i],level[i+1]));
+    }
+    if(level.size() % 2 == 1)
+      next.push_back(level.back());
+    level = next;
+  }
+  return level[0];
+}
+
+//Moves a matrix into the matrix table and returns its handle.
+int p1_context::new_matrix(matrix m)
+{
+  matrix_table.push_back(std::move(m));
+  return matrix_table.size()-1;
+}
+
+//Allocates a row-major float array for a rows x cols matrix. Small arrays are placed in the entry block of the
+//function so they are allocated once, large arrays are taken from the heap and freed at the return.
+Value* p1_context::allocate_storage(int rows,int cols)
+{
+  int count = rows*cols;
+  if(count*sizeof(float) <= stack_storage_limit)
+  {
+    Function *F = Builder.GetInsertBlock()->getParent();
+    IRBuilder<> EntryBuilder(&F->getEntryBlock(),F->getEntryBlock().begin());
+    return EntryBuilder.CreateAlloca(Builder.getFloatTy(),Builder.getInt32(count));
+  }
+  FunctionCallee malloc_fn = M->getOrInsertFunction("malloc",Builder.getInt8PtrTy(),Builder.getInt64Ty());
+  Value* bytes = Builder.CreateCall(malloc_fn,{Builder.getInt64((uint64_t)count*sizeof(float))});
+  Value* storage = Builder.CreateBitCast(bytes,PointerType::getUnqual(Builder.getFloatTy()));
+  heap_storage.push_back(bytes);
+  return storage;
+}
+
+//Frees all the heap allocated arrays. Called right before the return instruction. free is only declared in modules
+//which allocate on the heap.
+void p1_context::free_heap_storage()
+{
+  if(heap_storage.empty())
+    return;
+  FunctionCallee free_fn = M->getOrInsertFunction("free",Builder.getVoidTy(),Builder.getInt8PtrTy());
+  for(auto bytes: heap_storage)
+  {
+    Builder.CreateCall(free_fn,{bytes});
+  }
+  heap_storage.clear();
+}
+
+//Returns the flat index of element [row][col] of a row-major array with cols columns.
+Value* p1_context::flat_index(Value* row,Value* col,int cols)
+{
+  return Builder.CreateAdd(Builder.CreateMul(row,Builder.getInt32(cols)),col);
+}
+
+//Returns the address of element [row][col] of a row-major array with cols columns.
+Value* p1_context::element_ptr(Value* storage,Value* row,Value* col,int cols)
+{
+  return Builder.CreateGEP(Builder.getFloatTy(),storage,flat_index(row,col,cols));
+}
+
+//Loads element [row][col] of a matrix kept in storage.
+Value* p1_context::load_element(const matrix &m,Value* row,Value* col)
+{
+  return Builder.CreateLoad(Builder.getFloatTy(),element_ptr(m.storage,row,col,m.cols));
+}
+
+//Emits a counted loop which runs body for the induction values 0 to count-1. The body gets the induction variable
+//and the loop carried value (starting at init) and returns the updated loop carried value, or NULL when init is NULL.
+//Returns the loop carried value after the last iteration. The Builder is left at the exit of the loop.
+Value* p1_context::emit_loop(int count,Value* init,std::function<Value*(Value*,Value*)> body)
+{
+  Function *F = Builder.GetInsertBlock()->getParent();
+  BasicBlock *preheader = Builder.GetInsertBlock();
+  BasicBlock *loop = BasicBlock::Create(TheContext,"loop",F);
+  BasicBlock *exit = BasicBlock::Create(TheContext,"loop.exit",F);
+  Builder.CreateBr(loop);
+  Builder.SetInsertPoint(loop);
+
+  PHINode *index = Builder.CreatePHI(Builder.getInt32Ty(),2);
+  index->addIncoming(Builder.getInt32(0),preheader);
+  PHINode *carried = NULL;
+  if(init != NULL)
+  {
+    carried = Builder.CreatePHI(init->getType(),2);
+    carried->addIncoming(init,preheader);
+  }
+
+  Value* result = body(index,carried);
+
+  //The body may have created its own loops, so the latch is wherever the Builder is now.
+  BasicBlock *latch = Builder.GetInsertBlock();
+  Value* next = Builder.CreateAdd(index,Builder.getInt32(1));
+  Builder.CreateCondBr(Builder.CreateICmpSLT(next,Builder.getInt32(count)),loop,exit);
+  index->addIncoming(next,latch);
+  if(carried != NULL)
+    carried->addIncoming(result,latch);
+
+  Builder.SetInsertPoint(exit);
+  return result;
+}
+
+//Emits a loop which runs body for the induction values start to end-1, where the bounds are only known at run time
+//and the loop may not run at all. Works like emit_loop otherwise.
+Value* p1_context::emit_range_loop(Value* start,Value* end,Value* init,std::function<Value*(Value*,Value*)> body)
+{
+  Function *F = Builder.GetInsertBlock()->getParent();
+  BasicBlock *preheader = Builder.GetInsertBlock();
+  BasicBlock *header = BasicBlock::Create(TheContext,"range",F);
+  BasicBlock *loop = BasicBlock::Create(TheContext,"range.body",F);
+  BasicBlock *exit = BasicBlock::Create(TheContext,"range.exit",F);
+  Builder.CreateBr(header);
+  Builder.SetInsertPoint(header);
+
+  PHINode *index = Builder.CreatePHI(Builder.getInt32Ty(),2);
+  index->addIncoming(start,preheader);
+  PHINode *carried = NULL;
+  if(init != NULL)
+  {
+    carried = Builder.CreatePHI(init->getType(),2);
+    carried->addIncoming(init,preheader);
+  }
+  Builder.CreateCondBr(Builder.CreateICmpSLT(index,end),loop,exit);
+
+  Builder.SetInsertPoint(loop);
+  Value* result = body(index,carried);
+  BasicBlock *latch = Builder.GetInsertBlock();
+  index->addIncoming(Builder.CreateAdd(index,Builder.getInt32(1)),latch);
+  if(carried != NULL)
+    carried->addIncoming(result,latch);
+  Builder.CreateBr(header);
+
+  Builder.SetInsertPoint(exit);
+  return carried;
+}
+
+//Makes sure the matrix is kept in storage, storing the unrolled elements into a new array if needed.
+void p1_context::to_storage(matrix &m)
+{
+  if(m.storage != NULL)
+    return;
+  m.storage = allocate_storage(m.rows,m.cols);
+  for(int i=0;i<m.rows;i++)
+  {
+    for(int j=0;j<m.cols;j++)
+    {
+      Builder.CreateStore(m[i][j],element_ptr(m.storage,Builder.getInt32(i),Builder.getInt32(j),m.cols));
+    }
+  }
+}
+
+//Returns the matrix with its elements unrolled, loading them from storage the first time if needed.
+matrix& p1_context::unrolled(matrix &m)
+{
+  if(m.elements.empty() && m.storage != NULL)
+  {
+    for(int i=0;i<m.rows;i++)
+    {
+      for(int j=0;j<m.cols;j++)
+      {
+        m.elements.push_back(load_element(m,Builder.getInt32(i),Builder.getInt32(j)));
+      }
+    }
+  }
+  return m;
+}
+
+//Decides if an operation producing a rows x cols result from the given operands is generated with loops.
+bool p1_context::use_loops(const matrix &a,const matrix &b,int rows,int cols)
+{
+  return a.storage != NULL || b.storage != NULL || rows*cols > loop_threshold;
+}
+
+//Decides if an operation on matrices whose largest dimension is size calls libp1rt instead of generating the code.
+bool p1_context::use_runtime(int size)
+{
+  return runtime_cutoff > 0 && size >= runtime_cutoff;
+}
+
+//Calls a kernel of libp1rt, declared the first time with the types of the arguments. The matrices are passed as
+//pointers to their storage and the dimensions as ints, see p1rt.h.
+Value* p1_context::call_runtime(const char* name,Type* result,std::vector<Value*> args)
+{
+  std::vector<Type*> params;
+  for(auto arg: args)
+  {
+    params.push_back(arg->getType());
+  }
+  FunctionCallee kernel = M->getOrInsertFunction(name,FunctionType::get(result,params,false));
+  return Builder.CreateCall(kernel,args);
+}
+
+//Tells if a value is a zero constant, such elements are the structural zeros of a matrix.
+bool is_zero(Value* v)
+{
+  return PatternMatch::match(v,PatternMatch::m_AnyZeroFP());
+}
+
+//Finds the range of columns of every row outside which the row only holds zero constants, so identity, banded,
+//triangular and block diagonal matrices are known as such. Matrices which are only in storage are dense unless the
+//operation producing them set the ranges. An empty row has the range 0 to 0. Without the structure option every
+//matrix is dense.
+void p1_context::find_structure(matrix &m)
+{
+  if(!m.row_start.empty())
+    return;
+  m.row_start.assign(m.rows,0);
+  m.row_end.assign(m.rows,m.cols);
+  if(!structure || m.elements.empty())
+    return;
+  for(int i=0;i<m.rows;i++)
+  {
+    int start = m.cols;
+    int end = 0;
+    for(int j=0;j<m.cols;j++)
+    {
+      if(!is_zero(m[i][j]))
+      {
+        start = std::min(start,j);
+        end = j+1;
+      }
+    }
+    m.row_start[i] = start < end ? start : 0;
+    m.row_end[i] = start < end ? end : 0;
+  }
+}
+
+//Tells if the matrix has no structural zeros.
+bool p1_context::is_dense(matrix &m)
+{
+  find_structure(m);
+  for(int i=0;i<m.rows;i++)
+  {
+    if(m.row_start[i] != 0 || m.row_end[i] != m.cols)
+      return false;
+  }
+  return true;
+}
+
+//Tells if the matrix is an identity matrix, with ones on the diagonal and structural zeros everywhere else.
+bool p1_context::is_identity(matrix &m)
+{
+  if(m.rows != m.cols || m.elements.empty())
+    return false;
+  find_structure(m);
+  for(int i=0;i<m.rows;i++)
+  {
+    if(m.row_start[i] != i || m.row_end[i] != i+1 || !PatternMatch::match(m[i][i],PatternMatch::m_FPOne()))
+      return false;
+  }
+  return true;
+}
+
+//Tells if a square matrix is lower or upper triangular.
+bool p1_context::is_triangular(matrix &m)
+{
+  find_structure(m);
+  bool lower = true;
+  bool upper = true;
+  for(int i=0;i<m.rows;i++)
+  {
+    if(m.row_start[i] == m.row_end[i])
+      continue;
+    lower = lower && m.row_end[i] <= i+1;
+    upper = upper && m.row_start[i] >= i;
+  }
+  return lower || upper;
+}
+
+//Creates a constant table of one int per row, e.g. the column ranges of the rows for the loops over the structure of
+//a matrix. Returns a pointer to the first entry.
+Value* p1_context::row_table(const std::vector<int> &values)
+{
+  std::vector<uint32_t> entries(values.begin(),values.end());
+  Constant* init = ConstantDataArray::get(TheContext,entries);
+  GlobalVariable* table = new GlobalVariable(*M,init->getType(),true,GlobalValue::PrivateLinkage,init,"rows");
+  return ConstantExpr::getBitCast(table,PointerType::getUnqual(Builder.getInt32Ty()));
+}
+
+//Loads the entry of row i of a table of row_table.
+Value* p1_context::load_row(Value* table,Value* i)
+{
+  return Builder.CreateLoad(Builder.getInt32Ty(),Builder.CreateGEP(Builder.getInt32Ty(),table,i));
+}
+
+//Loads width consecutive floats starting at a flat index of a row-major array, as a vector unless width is 1.
+Value* p1_context::load_lanes(Value* storage,Value* index,int width)
+{
+  Value* ptr = Builder.CreateGEP(Builder.getFloatTy(),storage,index);
+  if(width == 1)
+    return Builder.CreateLoad(Builder.getFloatTy(),ptr);
+  Type* vector_type = FixedVectorType::get(Builder.getFloatTy(),width);
+  return Builder.CreateAlignedLoad(vector_type,Builder.CreateBitCast(ptr,PointerType::getUnqual(vector_type)),Align(4));
+}
+
+//Stores a float or a vector of floats at a flat index of a row-major array.
+void p1_context::store_lanes(Value* value,Value* storage,Value* index)
+{
+  Value* ptr = Builder.CreateGEP(Builder.getFloatTy(),storage,index);
+  if(value->getType()->isVectorTy())
+    ptr = Builder.CreateBitCast(ptr,PointerType::getUnqual(value->getType()));
+  Builder.CreateAlignedStore(value,ptr,Align(4));
+}
+
+//Broadcasts a scalar to all the lanes of a vector unless width is 1.
+Value* p1_context::splat(Value* scalar,int width)
+{
+  if(width == 1)
+    return scalar;
+  return Builder.CreateVectorSplat(width,scalar);
+}
+
+//Runs body over the indices 0 to count-1. With simd_width set, the body handles simd_width consecutive indices
+//at a time and then the leftover indices one at a time. The body gets the first index and the number of lanes.
+void p1_context::emit_lanes(int count,std::function<void(Value*,int)> body)
+{
+  int width = simd_width > 1 ? simd_width : 1;
+  int done = 0;
+  if(width > 1 && count >= width)
+  {
+    emit_loop(count/width,NULL,[&](Value* v,Value*) -> Value* {
+      body(Builder.CreateMul(v,Builder.getInt32(width)),width);
+      return NULL;
+    });
+    done = (count/width)*width;
+  }
+  if(done < count)
+  {
+    emit_loop(count-done,NULL,[&](Value* i,Value*) -> Value* {
+      body(done == 0 ? i : Builder.CreateAdd(i,Builder.getInt32(done)),1);
+      return NULL;
+    });
+  }
+}
+
+//Runs body over the indices start to end-1 like emit_lanes, for bounds only known at run time.
+void p1_context::emit_range_lanes(Value* start,Value* end,std::function<void(Value*,int)> body)
+{
+  int width = simd_width > 1 ? simd_width : 1;
+  Value* leftover = start;
+  if(width > 1)
+  {
+    Value* vectors = Builder.CreateSDiv(Builder.CreateSub(end,start),Builder.getInt32(width));
+    emit_range_loop(Builder.getInt32(0),vectors,NULL,[&](Value* v,Value*) -> Value* {
+      body(Builder.CreateAdd(start,Builder.CreateMul(v,Builder.getInt32(width))),width);
+      return NULL;
+    });
+    leftover = Builder.CreateAdd(start,Builder.CreateMul(vectors,Builder.getInt32(width)));
+  }
+  emit_range_loop(leftover,end,NULL,[&](Value* i,Value*) -> Value* {
+    body(i,1);
+    return NULL;
+  });
+}
+
+//Transposes a square block of vectors (the rows of the block) with shuffles. Every stage interleaves the rows
+//i and i+width/2, after log2(width) stages row c holds column c of the block.
+std::vector<Value*> p1_context::transpose_lanes(std::vector<Value*> block)
+{
+  int width = block.size();
+  std::vector<int> low,high;
+  for(int i=0;i<width/2;i++)
+  {
+    low.push_back(i);
+    low.push_back(i+width);
+    high.push_back(i+width/2);
+    high.push_back(i+width+width/2);
+  }
+  for(int stage=1;stage<width;stage*=2)
+  {
+    std::vector<Value*> next(width);
+    for(int i=0;i<width/2;i++)
+    {
+      next[2*i] = Builder.CreateShuffleVector(block[i],block[i+width/2],low);
+      next[2*i+1] = Builder.CreateShuffleVector(block[i],block[i+width/2],high);
+    }
+    block = next;
+  }
+  return block;
+}
+
+//Transpose of a matrix generated with loops. With simd_width set, whole blocks of simd_width x simd_width are
+//loaded as row vectors and transposed with shuffles, the edges of the matrix are copied one element at a time.
+matrix p1_context::transpose_loop(matrix &a)
+{
+  to_storage(a);
+  matrix result;
+  result.rows = a.cols;
+  result.cols = a.rows;
+  result.storage = allocate_storage(result.rows,result.cols);
+
+  //Large matrices are transposed by libp1rt, no blocks or elements are left to copy then.
+  bool runtime = use_runtime(std::max(a.rows,a.cols));
+  if(runtime)
+    call_runtime("p1rt_transpose",Builder.getVoidTy(),{a.storage,result.storage,Builder.getInt32(a.rows),
+                                                       Builder.getInt32(a.cols)});
+  int width = simd_width > 1 ? simd_width : 1;
+  int block_rows = width > 1 && !runtime ? a.rows/width : 0;
+  int block_cols = width > 1 && !runtime ? a.cols/width : 0;
+  if(block_rows > 0 && block_cols > 0)
+  {
+    emit_loop(block_rows,NULL,[&](Value* bi,Value*) -> Value* {
+      Value* i = Builder.CreateMul(bi,Builder.getInt32(width));
+      emit_loop(block_cols,NULL,[&](Value* bj,Value*) -> Value* {
+        Value* j = Builder.CreateMul(bj,Builder.getInt32(width));
+        std::vector<Value*> block;
+        for(int r=0;r<width;r++)
+        {
+          Value* row = Builder.CreateAdd(i,Builder.getInt32(r));
+          block.push_back(load_lanes(a.storage,flat_index(row,j,a.cols),width));
+        }
+        block = transpose_lanes(block);
+        for(int c=0;c<width;c++)
+        {
+          Value* row = Builder.CreateAdd(j,Builder.getInt32(c));
+          store_lanes(block[c],result.storage,flat_index(row,i,result.cols));
+        }
+        return NULL;
+      });
+      return NULL;
+    });
+  }
+
+  //Copies element [i][j] for the rows from row_start and the columns from col_start which are not in a block.
+  auto copy_elements = [&](int row_start,int row_end,int col_start) {
+    emit_range_loop(Builder.getInt32(row_start),Builder.getInt32(row_end),NULL,[&](Value* i,Value*) -> Value* {
+      emit_range_loop(Builder.getInt32(col_start),Builder.getInt32(a.cols),NULL,[&](Value* j,Value*) -> Value* {
+        Builder.CreateStore(load_element(a,i,j),element_ptr(result.storage,j,i,result.cols));
+        return NULL;
+      });
+      return NULL;
+    });
+  };
+  if(block_rows > 0 && block_cols > 0)
+  {
+    copy_elements(0,block_rows*width,block_cols*width);
+    copy_elements(block_rows*width,a.rows,0);
+  }
+  else if(!runtime)
+  {
+    copy_elements(0,a.rows,0);
+  }
+
+  //Row j of the transpose may not be zero from the first to the last row of a whose range holds column j.
+  if(structure && !is_dense(a))
+  {
+    result.row_start.assign(result.rows,0);
+    result.row_end.assign(result.rows,0);
+    for(int j=0;j<a.cols;j++)
+    {
+      for(int i=0;i<a.rows;i++)
+      {
+        if(a.row_start[i] <= j && j < a.row_end[i])
+        {
+          if(result.row_start[j] == result.row_end[j])
+            result.row_start[j] = i;
+          result.row_end[j] = i+1;
+        }
+      }
+    }
+  }
+  return result;
+}
+
+//Picks the tile size for the product of a rows x inner and an inner x cols matrix, 0 means no tiling.
+int p1_context::product_tile(int rows,int inner,int cols)
+{
+  if(tile_size >= 0)
+    return tile_size;
+  //Products whose operands and result fit in the cache together gain nothing from tiling.
+  if((rows*inner + inner*cols + rows*cols)*sizeof(float) <= tile_cache_bytes)
+    return 0;
+  //Largest power of two for which one tile of a, b and the result fit in the cache together.
+  int tile = 8;
+  while(3*(2*tile)*(2*tile)*sizeof(float) <= tile_cache_bytes)
+    tile *= 2;
+  return tile;
+}
+
+//Returns the end of the tile starting at start, clamped to the size of the dimension.
+Value* p1_context::tile_end(Value* start,int tile,int size)
+{
+  Value* end = Builder.CreateAdd(start,Builder.getInt32(tile));
+  return Builder.CreateSelect(Builder.CreateICmpSLT(end,Builder.getInt32(size)),end,Builder.getInt32(size));
+}
+
+//Blocked matrix product. The tiles of the result are accumulated over the tiles of the inner dimension so the tiles
+//of a and b being combined stay in the cache. Inside a tile every element (or vector of simd_width elements) of the
+//result is loaded once and accumulated over the tile in a register. The sums of every element still run over k in
+//increasing order, as in the plain loop nest.
+void p1_context::tiled_product_loop(const matrix &a,const matrix &b,const matrix &result,int tile)
+{
+  Value* zero = ConstantFP::get(Type::getFloatTy(TheContext), 0.0);
+  emit_lanes(result.rows*result.cols,[&](Value* i,int width) {
+    store_lanes(splat(zero,width),result.storage,i);
+  });
+  int tiles_i = (a.rows+tile-1)/tile;
+  int tiles_j = (b.cols+tile-1)/tile;
+  int tiles_k = (a.cols+tile-1)/tile;
+  emit_loop(tiles_i,NULL,[&](Value* ti,Value*) -> Value* {
+    Value* i0 = Builder.CreateMul(ti,Builder.getInt32(tile));
+    Value* i1 = tile_end(i0,tile,a.rows);
+    emit_loop(tiles_j,NULL,[&](Value* tj,Value*) -> Value* {
+      Value* j0 = Builder.CreateMul(tj,Builder.getInt32(tile));
+      Value* j1 = tile_end(j0,tile,b.cols);
+      emit_loop(tiles_k,NULL,[&](Value* tk,Value*) -> Value* {
+        Value* k0 = Builder.CreateMul(tk,Builder.getInt32(tile));
+        Value* k1 = tile_end(k0,tile,a.cols);
+        emit_range_loop(i0,i1,NULL,[&](Value* i,Value*) -> Value* {
+          emit_range_lanes(j0,j1,[&](Value* j,int width) {
+            Value* index = flat_index(i,j,result.cols);
+            Value* sum = emit_range_loop(k0,k1,load_lanes(result.storage,index,width),[&](Value* k,Value* sum) -> Value* {
+              Value* first = splat(load_element(a,i,k),width);
+              Value* second = load_lanes(b.storage,flat_index(k,j,b.cols),width);
+              return fmuladd(first,second,sum);
+            });
+            store_lanes(sum,result.storage,index);
+          });
+          return NULL;
+        });
+        return NULL;
+      });
+      return NULL;
+    });
+    return NULL;
+  });
+}
+
+//Matrix product generated with a loop nest over the rows of a, the columns of b and the inner dimension. With
+//simd_width set, simd_width columns of the result are computed at once from vectors of the rows of b. Products
+//too big for the cache are generated as a blocked loop nest instead.
+matrix p1_context::product_loop(matrix &a,matrix &b)
+{
+  to_storage(a);
+  to_storage(b);
+  matrix result;
+  result.rows = a.rows;
+  result.cols = b.cols;
+  result.storage = allocate_storage(result.rows,result.cols);
+  int tile = product_tile(a.rows,a.cols,b.cols);
+  if(tile > 0)
+  {
+    tiled_product_loop(a,b,result,tile);
+    return result;
+  }
+  Value* zero = ConstantFP::get(Type::getFloatTy(TheContext), 0.0);
+  emit_loop(a.rows,NULL,[&](Value* i,Value*) -> Value* {
+    emit_lanes(b.cols,[&](Value* j,int width) {
+      Value* inner_product = emit_loop(a.cols,splat(zero,width),[&](Value* k,Value* sum) -> Value* {
+        Value* first = splat(load_element(a,i,k),width);
+        Value* second = load_lanes(b.storage,flat_index(k,j,b.cols),width);
+        return fmuladd(first,second,sum);
+      });
+      store_lanes(inner_product,result.storage,flat_index(i,j,result.cols));
+    });
+    return NULL;
+  });
+  return result;
+}
+
+//Finds the ranges of the columns of the rows of the product of a and b which may not be zero, those of the rows of b
+//row i of a picks. Returns the floating point operations of the product over these ranges.
+long p1_context::banded_ranges(matrix &a,matrix &b,std::vector<int> &row_start,std::vector<int> &row_end)
+{
+  find_structure(a);
+  find_structure(b);
+  row_start.assign(a.rows,0);
+  row_end.assign(a.rows,0);
+  long flops = 0;
+  for(int i=0;i<a.rows;i++)
+  {
+    int start = b.cols;
+    int end = 0;
+    for(int k=a.row_start[i];k<a.row_end[i];k++)
+    {
+      if(b.row_start[k] < b.row_end[k])
+      {
+        start = std::min(start,b.row_start[k]);
+        end = std::max(end,b.row_end[k]);
+      }
+    }
+    if(start < end)
+    {
+      row_start[i] = start;
+      row_end[i] = end;
+    }
+    flops += 2L*(row_end[i]-row_start[i])*(a.row_end[i]-a.row_start[i]);
+  }
+  return flops;
+}
+
+//Product of matrices with structural zeros generated with loops. Row i of the result only runs over the columns which
+//may not be zero and its inner products only over the columns of row i of a which may not be zero, so the product of
+//two n x n matrices with bandwidth w takes O(n*w^2) operations instead of O(n^3). The rest of the result is set to
+//zero. The ranges of the rows are known while compiling and looked up in constant tables by the loops.
+matrix p1_context::banded_product_loop(matrix &a,matrix &b)
+{
+  to_storage(a);
+  to_storage(b);
+  matrix result;
+  result.rows = a.rows;
+  result.cols = b.cols;
+  result.storage = allocate_storage(result.rows,result.cols);
+  long flops = banded_ranges(a,b,result.row_start,result.row_end);
+  structural_flops += 2L*a.rows*a.cols*b.cols - flops;
+
+  Value* zero = ConstantFP::get(Type::getFloatTy(TheContext), 0.0);
+  emit_lanes(result.rows*result.cols,[&](Value* i,int width) {
+    store_lanes(splat(zero,width),result.storage,i);
+  });
+  Value* a_start = row_table(a.row_start);
+  Value* a_end = row_table(a.row_end);
+  Value* result_start = row_table(result.row_start);
+  Value* result_end = row_table(result.row_end);
+  emit_loop(a.rows,NULL,[&](Value* i,Value*) -> Value* {
+    Value* k0 = load_row(a_start,i);
+    Value* k1 = load_row(a_end,i);
+    emit_range_loop(load_row(result_start,i),load_row(result_end,i),NULL,[&](Value* j,Value*) -> Value* {
+      Value* inner_product = emit_range_loop(k0,k1,zero,[&](Value* k,Value* sum) -> Value* {
+        return fmuladd(load_element(a,i,k),load_element(b,k,j),sum);
+      });
+      Builder.CreateStore(inner_product,element_ptr(result.storage,i,j,result.cols));
+      return NULL;
+    });
+    return NULL;
+  });
+  return result;
+}
+
+//Matrix product computed by the GEMM kernel of libp1rt.
+matrix p1_context::runtime_product(matrix &a,matrix &b)
+{
+  to_storage(a);
+  to_storage(b);
+  matrix result;
+  result.rows = a.rows;
+  result.cols = b.cols;
+  result.storage = allocate_storage(result.rows,result.cols);
+  call_runtime("p1rt_gemm",Builder.getVoidTy(),{a.storage,b.storage,result.storage,Builder.getInt32(a.rows),
+                                                Builder.getInt32(a.cols),Builder.getInt32(b.cols)});
+  return result;
+}
+
+//Generates the LU decomposition of a square matrix with loops. The matrix is copied first (transposed if requested)
+//so the factors can be computed in place.
+lu_factors p1_context::lu_decompose(matrix &a,bool transposed)
+{
+  to_storage(a);
+  lu_factors f;
+  f.n = a.rows;
+  f.lu = allocate_storage(f.n,f.n);
+  Function *F = Builder.GetInsertBlock()->getParent();
+  IRBuilder<> EntryBuilder(&F->getEntryBlock(),F->getEntryBlock().begin());
+  f.perm = EntryBuilder.CreateAlloca(Builder.getInt32Ty(),Builder.getInt32(f.n));
+
+  int n = f.n;
+  Value* lu = f.lu;
+  Value* perm = f.perm;
+  Value* size = Builder.getInt32(n);
+  emit_loop(n,NULL,[&](Value* i,Value*) -> Value* {
+    Builder.CreateStore(i,Builder.CreateGEP(Builder.getInt32Ty(),perm,i));
+    emit_loop(n,NULL,[&](Value* j,Value*) -> Value* {
+      Value* element = transposed ? load_element(a,j,i) : load_element(a,i,j);
+      Builder.CreateStore(element,element_ptr(lu,i,j,n));
+      return NULL;
+    });
+    return NULL;
+  });
+
+  Value* one = ConstantFP::get(Type::getFloatTy(TheContext), 1.0);
+  f.sign = emit_loop(n,one,[&](Value* k,Value* sign) -> Value* {
+    Value* next = Builder.CreateAdd(k,Builder.getInt32(1));
+    //Pivot is the row with the largest magnitude in column k.
+    Value* pivot = emit_range_loop(next,size,k,[&](Value* i,Value* best) -> Value* {
+      Value* candidate = Builder.CreateUnaryIntrinsic(Intrinsic::fabs,Builder.CreateLoad(Builder.getFloatTy(),element_ptr(lu,i,k,n)));
+      Value* current = Builder.CreateUnaryIntrinsic(Intrinsic::fabs,Builder.CreateLoad(Builder.getFloatTy(),element_ptr(lu,best,k,n)));
+      return Builder.CreateSelect(Builder.CreateFCmpOGT(candidate,current),i,best);
+    });
+
+    //Swapping the pivot row into row k.
+    emit_loop(n,NULL,[&](Value* j,Value*) -> Value* {
+      Value* x = Builder.CreateLoad(Builder.getFloatTy(),element_ptr(lu,k,j,n));
+      Value* y = Builder.CreateLoad(Builder.getFloatTy(),element_ptr(lu,pivot,j,n));
+      Builder.CreateStore(y,element_ptr(lu,k,j,n));
+      Builder.CreateStore(x,element_ptr(lu,pivot,j,n));
+      return NULL;
+    });
+    Value* perm_k = Builder.CreateGEP(Builder.getInt32Ty(),perm,k);
+    Value* perm_pivot = Builder.CreateGEP(Builder.getInt32Ty(),perm,pivot);
+    Value* row_k = Builder.CreateLoad(Builder.getInt32Ty(),perm_k);
+    Value* row_pivot = Builder.CreateLoad(Builder.getInt32Ty(),perm_pivot);
+    Builder.CreateStore(row_pivot,perm_k);
+    Builder.CreateStore(row_k,perm_pivot);
+    Value* swapped_sign = Builder.CreateSelect(Builder.CreateICmpNE(pivot,k),fneg(sign),sign);
+
+    //Eliminating column k from the rows below the pivot. A zero pivot means the whole column is zero below the diagonal
+    //and the matrix is singular, so the column is skipped instead of dividing by zero and the determinant comes out 0.
+    Value* diagonal = Builder.CreateLoad(Builder.getFloatTy(),element_ptr(lu,k,k,n));
+    Value* zero = ConstantFP::get(Type::getFloatTy(TheContext), 0.0);
+    Value* first = Builder.CreateSelect(Builder.CreateFCmpOEQ(diagonal,zero),size,next);
+    emit_range_loop(first,size,NULL,[&](Value* i,Value*) -> Value* {
+      Value* factor = fdiv(Builder.CreateLoad(Builder.getFloatTy(),element_ptr(lu,i,k,n)),diagonal);
+      Builder.CreateStore(factor,element_ptr(lu,i,k,n));
+      emit_range_loop(next,size,NULL,[&](Value* j,Value*) -> Value* {
+        Value* x = Builder.CreateLoad(Builder.getFloatTy(),element_ptr(lu,i,j,n));
+        Value* y = Builder.CreateLoad(Builder.getFloatTy(),element_ptr(lu,k,j,n));
+        Builder.CreateStore(fmulsub(factor,y,x),element_ptr(lu,i,j,n));
+        return NULL;
+      });
+      return NULL;
+    });
+    return swapped_sign;
+  });
+  return f;
+}
+
+//Determinant from the LU factors: sign of the permutation times the product of the diagonal of U.
+Value* p1_context::lu_determinant(const lu_factors &f)
+{
+  return emit_loop(f.n,f.sign,[&](Value* i,Value* product) -> Value* {
+    return fmul(product,Builder.CreateLoad(Builder.getFloatTy(),element_ptr(f.lu,i,i,f.n)));
+  });
+}
+
+//Determinant of a triangular matrix, the product of its diagonal, instead of the LU decomposition.
+Value* p1_context::triangular_determinant(matrix &m)
+{
+  int n = m.rows;
+  //Floating point operations of the LU decomposition which are saved, the product of the diagonal is left.
+  for(int k=0;k<n;k++)
+  {
+    structural_flops += (long)(n-k-1)*(1+2*(n-k-1));
+  }
+  Value* one = ConstantFP::get(Type::getFloatTy(TheContext), 1.0);
+  if(!m.elements.empty())
+  {
+    Value* product = one;
+    for(int i=0;i<n;i++)
+    {
+      product = fmul(product,m[i][i]);
+    }
+    return product;
+  }
+  return emit_loop(n,one,[&](Value* i,Value* product) -> Value* {
+    return fmul(product,load_element(m,i,i));
+  });
+}
+
+//Solves A X = B for the given number of columns of B with the LU factors of A, using forward substitution with L and
+//back substitution with U. rhs returns element [i][c] of B. The solution is stored into result, indexed [c][i] instead
+//of [i][c] when transposed is set.
+void p1_context::lu_solve(const lu_factors &f,int columns,std::function<Value*(Value*,Value*)> rhs,Value* result,bool transposed)
+{
+  int n = f.n;
+  Value* size = Builder.getInt32(n);
+  auto solution = [&](Value* i,Value* c) -> Value* {
+    return transposed ? element_ptr(result,c,i,n) : element_ptr(result,i,c,columns);
+  };
+  auto row_sum = [&](Value* i,Value* c,Value* start,Value* end,Value* init) -> Value* {
+    return emit_range_loop(start,end,init,[&](Value* j,Value* sum) -> Value* {
+      Value* x = Builder.CreateLoad(Builder.getFloatTy(),element_ptr(f.lu,i,j,n));
+      Value* y = Builder.CreateLoad(Builder.getFloatTy(),solution(j,c));
+      return fmulsub(x,y,sum);
+    });
+  };
+
+  emit_loop(columns,NULL,[&](Value* c,Value*) -> Value* {
+    //Forward substitution with L, picking the rows of B in pivot order.
+    emit_loop(n,NULL,[&](Value* i,Value*) -> Value* {
+      Value* row = Builder.CreateLoad(Builder.getInt32Ty(),Builder.CreateGEP(Builder.getInt32Ty(),f.perm,i));
+      Value* y = row_sum(i,c,Builder.getInt32(0),i,rhs(row,c));
+      Builder.CreateStore(y,solution(i,c));
+      return NULL;
+    });
+    //Back substitution with U, from the last row up.
+    emit_loop(n,NULL,[&](Value* r,Value*) -> Value* {
+      Value* i = Builder.CreateSub(Builder.getInt32(n-1),r);
+      Value* y = Builder.CreateLoad(Builder.getFloatTy(),solution(i,c));
+      Value* x = row_sum(i,c,Builder.CreateAdd(i,Builder.getInt32(1)),size,y);
+      Value* diagonal = Builder.CreateLoad(Builder.getFloatTy(),element_ptr(f.lu,i,i,n));
+      Builder.CreateStore(fdiv(x,diagonal),solution(i,c));
+      return NULL;
+    });
+    return NULL;
+  });
+}
+
+//Inverse of a square matrix generated with loops by solving A X = I with the LU factors of A, or computed by libp1rt
+//above the cutoff.
+matrix p1_context::inverse_loop(matrix &a)
+{
+  if(use_runtime(a.rows))
+  {
+    to_storage(a);
+    matrix result;
+    result.rows = a.rows;
+    result.cols = a.cols;
+    result.storage = allocate_storage(result.rows,result.cols);
+    call_runtime("p1rt_invert",Builder.getVoidTy(),{a.storage,result.storage,Builder.getInt32(a.rows)});
+    return result;
+  }
+  lu_factors f = lu_decompose(a,false);
+  matrix result;
+  result.rows = f.n;
+  result.cols = f.n;
+  result.storage = allocate_storage(f.n,f.n);
+  Value* one = ConstantFP::get(Type::getFloatTy(TheContext), 1.0);
+  Value* zero = ConstantFP::get(Type::getFloatTy(TheContext), 0.0);
+  lu_solve(f,f.n,[&](Value* i,Value* c) -> Value* {
+    return Builder.CreateSelect(Builder.CreateICmpEQ(i,c),one,zero);
+  },result.storage,false);
+  return result;
+}
+
+//Matrix division A / B = A * inverse(B) generated with loops without forming the inverse. Every row x of the result
+//solves x B = a for the matching row a of A, i.e. transpose(B) x = a, so the LU factors of transpose(B) are used.
+matrix p1_context::divide_loop(matrix &a,matrix &b)
+{
+  lu_factors f = lu_decompose(b,true);
+  to_storage(a);
+  matrix result;
+  result.rows = a.rows;
+  result.cols = f.n;
+  result.storage = allocate_storage(result.rows,result.cols);
+  lu_solve(f,a.rows,[&](Value* i,Value* c) -> Value* {
+    return load_element(a,c,i);
+  },result.storage,true);
+  return result;
+}
+
+//Creates a leaf of a matrix expression.
+mat_expr* p1_context::leaf_expr(int handle)
+{
+  mat_expr *e = make<mat_expr>();
+  e->rows = matrix_table[handle].rows;
+  e->cols = matrix_table[handle].cols;
+  e->value = handle;
+  return e;
+}
+
+//Creates a leaf holding the result of a non elementwise operation.
+mat_expr* p1_context::result_expr(matrix m)
+{
+  return leaf_expr(new_matrix(std::move(m)));
+}
+
+//Creates an elementwise node. right is NULL for the scalar operations and negation, scalar is NULL otherwise.
+mat_expr* p1_context::elementwise_expr(mat_expr_kind kind,mat_expr *left,mat_expr *right,Value* scalar)
+{
+  mat_expr *e = make<mat_expr>();
+  e->kind = kind;
+  e->rows = left->rows;
+  e->cols = left->cols;
+  e->left = left;
+  e->right = right;
+  e->scalar = scalar;
+  return e;
+}
+
+//Creates a matrix product node. The caller checks that the dimensions match.
+mat_expr* p1_context::product_expr(mat_expr *left,mat_expr *right)
+{
+  mat_expr *e = make<mat_expr>();
+  e->kind = MAT_PRODUCT;
+  e->rows = left->rows;
+  e->cols = right->cols;
+  e->left = left;
+  e->right = right;
+  return e;
+}
+
+//Collects the operands of a chain of matrix products, from left to right.
+void chain_operands(mat_expr *e,std::vector<mat_expr*> &operands)
+{
+  if(e->kind != MAT_PRODUCT)
+  {
+    operands.push_back(e);
+    return;
+  }
+  chain_operands(e->left,operands);
+  chain_operands(e->right,operands);
+}
+
+//Floating point operations (a multiply and an add per term) of the products of a chain in the order they are written.
+long written_flops(mat_expr *e)
+{
+  if(e->kind != MAT_PRODUCT)
+    return 0;
+  return written_flops(e->left) + written_flops(e->right) + 2L*e->left->rows*e->left->cols*e->right->cols;
+}
+
+//Evaluates a chain of matrix products, e.g. A*B*v, in the order with the fewest floating point operations. The classic
+//dynamic programming over the dimensions finds the cheapest parenthesization, so A*(B*v) is generated for a vector v
+//instead of the O(n^3) (A*B)*v. The operands of the chain are evaluated first. The node becomes a leaf of the result.
+void p1_context::evaluate_chain(mat_expr *e)
+{
+  std::vector<mat_expr*> operands;
+  chain_operands(e,operands);
+  int n = operands.size();
+  //Operand i is dims[i] x dims[i+1].
+  std::vector<long> dims;
+  for(auto op: operands)
+  {
+    evaluate(op);
+    dims.push_back(op->rows);
+  }
+  dims.push_back(operands.back()->cols);
+
+  //cost[i][j] is the cheapest cost of the product of the operands i to j, split[i][j] the last product done for it.
+  std::vector<std::vector<long>> cost(n,std::vector<long>(n,0));
+  std::vector<std::vector<int>> split(n,std::vector<int>(n,0));
+  for(int length=2;length<=n;length++)
+  {
+    for(int i=0;i+length-1<n;i++)
+    {
+      int j = i+length-1;
+      cost[i][j] = -1;
+      for(int k=i;k<j;k++)
+      {
+        long c = cost[i][k] + cost[k+1][j] + 2*dims[i]*dims[k+1]*dims[j+1];
+        if(cost[i][j] < 0 || c < cost[i][j])
+        {
+          cost[i][j] = c;
+          split[i][j] = k;
+        }
+      }
+    }
+  }
+  long written = written_flops(e);
+  if(chain_stats && n > 2)
+    errs() << M->getName() << ": chain of " << n << " matrices, " << written << " FLOPs as written, "
+           << (chain_order ? cost[0][n-1] : written) << " FLOPs reordered\n";
+
+  //Multiplies the operands i to j and returns the handle of the result.
+  std::function<int(int,int)> multiply = [&](int i,int j) -> int {
+    if(i == j)
+      return operands[i]->value;
+    int a = multiply(i,split[i][j]);
+    int b = multiply(split[i][j]+1,j);
+    return new_matrix(matrix_product(matrix_table[a],matrix_table[b]));
+  };
+  //Multiplies in the order of the expression.
+  std::function<int(mat_expr*)> multiply_written = [&](mat_expr *p) -> int {
+    if(p->kind != MAT_PRODUCT)
+      return p->value;
+    int a = multiply_written(p->left);
+    int b = multiply_written(p->right);
+    return new_matrix(matrix_product(matrix_table[a],matrix_table[b]));
+  };
+  e->value = chain_order ? multiply(0,n-1) : multiply_written(e);
+  e->kind = MAT_LEAF;
+  e->left = NULL;
+  e->right = NULL;
+}
+
+//Evaluates the chains of matrix products in the expression, only elementwise nodes and leaves are left.
+void p1_context::evaluate_products(mat_expr *e)
+{
+  if(e->kind == MAT_LEAF)
+    return;
+  if(e->kind == MAT_PRODUCT)
+  {
+    evaluate_chain(e);
+    return;
+  }
+  evaluate_products(e->left);
+  if(e->right != NULL)
+    evaluate_products(e->right);
+}
+
+//Collects the matrices at the leaves of the expression.
+void p1_context::expr_leaves(mat_expr *e,std::vector<matrix*> &leaves)
+{
+  if(e->kind == MAT_LEAF)
+  {
+    leaves.push_back(&matrix_table[e->value]);
+    return;
+  }
+  expr_leaves(e->left,leaves);
+  if(e->right != NULL)
+    expr_leaves(e->right,leaves);
+}
+
+//Applies the operation of an elementwise node to the values of its operands. y is the right operand or the scalar.
+Value* p1_context::combine(mat_expr *e,Value* x,Value* y)
+{
+  switch(e->kind)
+  {
+    case MAT_ADD: return fadd(x,y);
+    case MAT_SUB: return fsub(x,y);
+    case MAT_SCALE: return fmul(x,y);
+    case MAT_DIVIDE: return fdiv(x,y);
+    default: return fneg(x);
+  }
+}
+
+//Value of element [i][j] of an expression whose leaves are unrolled.
+Value* p1_context::element_value(mat_expr *e,int i,int j)
+{
+  if(e->kind == MAT_LEAF)
+    return unrolled(matrix_table[e->value])[i][j];
+  Value* x = element_value(e->left,i,j);
+  Value* y = e->right != NULL ? element_value(e->right,i,j) : e->scalar;
+  return combine(e,x,y);
+}
+
+//Value of width consecutive elements starting at a flat index of an expression whose leaves are in storage.
+Value* p1_context::lanes_value(mat_expr *e,Value* index,int width)
+{
+  if(e->kind == MAT_LEAF)
+    return load_lanes(matrix_table[e->value].storage,index,width);
+  Value* x = lanes_value(e->left,index,width);
+  Value* y = e->right != NULL ? lanes_value(e->right,index,width) : (e->scalar != NULL ? splat(e->scalar,width) : NULL);
+  return combine(e,x,y);
+}
+
+//Decides if the expression is evaluated with a loop: when it has more than loop_threshold elements or any of its
+//leaves is kept in storage.
+bool p1_context::expr_uses_loops(mat_expr *e,std::vector<matrix*> &leaves)
+{
+  if(e->rows*e->cols > loop_threshold)
+    return true;
+  for(auto m: leaves)
+  {
+    if(m->storage != NULL)
+      return true;
+  }
+  return false;
+}
+
+//Column ranges of the rows of an elementwise expression which may not be zero: the union of the ranges of the operands
+//of a sum or a difference, the ranges of the matrix operand otherwise.
+void p1_context::expr_structure(mat_expr *e,std::vector<int> &start,std::vector<int> &end)
+{
+  if(e->kind == MAT_LEAF)
+  {
+    matrix &m = matrix_table[e->value];
+    find_structure(m);
+    start = m.row_start;
+    end = m.row_end;
+    return;
+  }
+  expr_structure(e->left,start,end);
+  if(e->right == NULL)
+    return;
+  std::vector<int> right_start,right_end;
+  expr_structure(e->right,right_start,right_end);
+  for(int i=0;i<e->rows;i++)
+  {
+    if(start[i] == end[i])
+    {
+      start[i] = right_start[i];
+      end[i] = right_end[i];
+    }
+    else if(right_start[i] < right_end[i])
+    {
+      start[i] = std::min(start[i],right_start[i]);
+      end[i] = std::max(end[i],right_end[i]);
+    }
+  }
+}
+
+//Evaluates a matrix expression with a single pass over its elements. The node becomes a leaf holding the handle of
+//the result so it is evaluated only once.
+matrix& p1_context::evaluate(mat_expr *e)
+{
+  evaluate_products(e);
+  if(e->kind == MAT_LEAF)
+    return matrix_table[e->value];
+  std::vector<matrix*> leaves;
+  expr_leaves(e,leaves);
+  matrix result;
+  if(expr_uses_loops(e,leaves))
+  {
+    for(auto m: leaves)
+    {
+      to_storage(*m);
+    }
+    result.rows = e->rows;
+    result.cols = e->cols;
+    result.storage = allocate_storage(result.rows,result.cols);
+    emit_lanes(e->rows*e->cols,[&](Value* i,int width) {
+      store_lanes(lanes_value(e,i,width),result.storage,i);
+    });
+    if(structure)
+      expr_structure(e,result.row_start,result.row_end);
+  }
+  else
+  {
+    result = make_matrix(e->rows,e->cols);
+    for(int i=0;i<e->rows;i++)
+    {
+      for(int j=0;j<e->cols;j++)
+      {
+        result[i][j] = element_value(e,i,j);
+      }
+    }
+  }
+  e->kind = MAT_LEAF;
+  e->value = new_matrix(std::move(result));
+  e->left = NULL;
+  e->right = NULL;
+  return matrix_table[e->value];
+}
 
 //struct datatype to find out whether the variable is a value or matrix type
 struct var_or_mat
 {
   bool is_var=false;
   Value* value=NULL;
-  //Storing the matrix name instead of passing pointers
-  std::string mat_name;
+  //Lazy expression of the matrix, evaluated when it is assigned or used by a non elementwise operation.
+  mat_expr *mat=NULL;
 };
-//Performs matrix reduction operation. Returns a Value* type and takes std::string matrix name as argument.
-Value* reduction(std::string mat_name)
+//Performs matrix reduction operation. Returns a Value* type and takes the matrix expression as argument. The
+//expression is summed element by element without evaluating it into a matrix first.
+Value* p1_context::reduction(mat_expr *e)
 {
-  std::vector<std::vector<Value*> > a = matrices[mat_name];
   Value* result = ConstantFP::get(Type::getFloatTy(TheContext), 0.0);
-  for(int i=0;i<a.size();i++)
+  evaluate_products(e);
+  std::vector<matrix*> leaves;
+  expr_leaves(e,leaves);
+  if(expr_uses_loops(e,leaves))
+  {
+    for(auto m: leaves)
+    {
+      to_storage(*m);
+    }
+    int count = e->rows*e->cols;
+    //Only the columns of every row which may not be zero are summed.
+    std::vector<int> start,end;
+    long terms = count;
+    if(structure)
+    {
+      expr_structure(e,start,end);
+      terms = 0;
+      for(int i=0;i<e->rows;i++)
+      {
+        terms += end[i]-start[i];
+      }
+    }
+    if(terms < count)
+    {
+      structural_flops += count-terms;
+      Value* start_table = row_table(start);
+      Value* end_table = row_table(end);
+      return emit_loop(e->rows,result,[&](Value* i,Value* sum) -> Value* {
+        return emit_range_loop(load_row(start_table,i),load_row(end_table,i),sum,[&](Value* j,Value* sum) -> Value* {
+          return fadd(sum,lanes_value(e,flat_index(i,j,e->cols),1));
+        });
+      });
+    }
+    //An evaluated matrix is summed by libp1rt above the cutoff, elementwise expressions are still summed in one pass
+    //over their operands.
+    if(e->kind == MAT_LEAF && use_runtime(std::max(e->rows,e->cols)))
+      return call_runtime("p1rt_reduce",Builder.getFloatTy(),{matrix_table[e->value].storage,Builder.getInt32(count)});
+    //In fast-math mode the loop keeps a vector of partial sums, one accumulator per lane, which are added up as a
+    //tree at the end. The elements left over are added one at a time.
+    int width = simd_width > 1 ? simd_width : 4;
+    if(fast_math && count >= width)
+    {
+      Value* partial = emit_loop(count/width,splat(result,width),[&](Value* v,Value* sum) -> Value* {
+        return fadd(sum,lanes_value(e,Builder.CreateMul(v,Builder.getInt32(width)),width));
+      });
+      result = Builder.CreateFAddReduce(result,partial);
+      for(int i=(count/width)*width;i<count;i++)
+      {
+        result = fadd(result,lanes_value(e,Builder.getInt32(i),1));
+      }
+      return result;
+    }
+    return emit_loop(count,result,[&](Value* i,Value* sum) -> Value* {
+      return fadd(sum,lanes_value(e,i,1));
+    });
+  }
+  std::vector<Value*> terms;
+  for(int i=0;i<e->rows;i++)
   {
-    for(int j=0;j<a[i].size();j++)
+    for(int j=0;j<e->cols;j++)
     {
-      result = Builder.CreateFAdd(result,a[i][j]);
+      Value* term = element_value(e,i,j);
+      if(structure && is_zero(term))
+      {
+        structural_flops++;
+        continue;
+      }
+      terms.push_back(term);
     }
   }
-  return result;
+  return sum_terms(terms);
 }
-//Performs matrix multiplication operation. Returns matrix name of the resultant matrix and takes 2 arguments 
-//of type std::string which are the two matrices whose product needs to be computed.
-std::string matrix_product(std::string a_mat,std::string b_mat)
+//Performs matrix multiplication operation. Returns the resultant matrix and takes the 2 matrices whose product
+//needs to be computed. The caller checks that the dimensions match.
+matrix p1_context::matrix_product(matrix &a_mat,matrix &b_mat)
 {
-  std::vector<std::vector<Value*> > a = matrices[a_mat];
-  std::vector<std::vector<Value*> > b = matrices[b_mat];
-  
-  std::vector<std::vector<Value*> > vec;
-    
-  if(a[0].size() != b.size())
+  //The product with an identity matrix is the other operand.
+  if(structure && (is_identity(a_mat) || is_identity(b_mat)))
+  {
+    structural_flops += 2L*a_mat.rows*a_mat.cols*b_mat.cols;
+    return is_identity(a_mat) ? b_mat : a_mat;
+  }
+  //Large products are generated as a loop nest over the arrays, which skips the structural zeros if they save at least
+  //half of the operations. Otherwise the scalar banded loop would be slower than the tiled, vectorized or runtime
+  //product of the whole matrices.
+  if(use_loops(a_mat,b_mat,a_mat.rows,b_mat.cols))
   {
-    // If the matrix product size rules doesn't match, it aborts.
-    yyerror("Matrix multiplication dimension error\n");
-    return "error";
+    std::vector<int> row_start,row_end;
+    if(structure && (!is_dense(a_mat) || !is_dense(b_mat)) &&
+       2*banded_ranges(a_mat,b_mat,row_start,row_end) <= 2L*a_mat.rows*a_mat.cols*b_mat.cols)
+      return banded_product_loop(a_mat,b_mat);
+    if(use_runtime(std::max({a_mat.rows,a_mat.cols,b_mat.cols})))
+      return runtime_product(a_mat,b_mat);
+    return product_loop(a_mat,b_mat);
   }
+
+  matrix &a = unrolled(a_mat);
+  matrix &b = unrolled(b_mat);
+  
+  matrix vec = make_matrix(a.rows,b.cols);
     
-  for(int i=0;i<a.size();i++)
+  for(int i=0;i<a.rows;i++)
   {
-      std::vector<Value*> row_vec;
-      for(int j=0;j<b[i].size();j++)
+      for(int j=0;j<b.cols;j++)
       {
-        Value* inner_product = ConstantFP::get(Type::getFloatTy(TheContext), 0.0);
-        for(int k=0;k<b.size();k++)
+        //In fast-math mode the inner product is spread over several accumulators with multiply-adds, which are
+        //summed as a tree, otherwise it is one chain of additions.
+        std::vector<Value*> accumulators(fast_math ? product_accumulators : 1,
+                                         ConstantFP::get(Type::getFloatTy(TheContext), 0.0));
+        for(int k=0;k<b.rows;k++)
         {
           Value* first = a[i][k];
           Value* second = b[k][j];
-          Value* product = Builder.CreateFMul(first,second);
-          inner_product = Builder.CreateFAdd(inner_product,product);
+          //Terms with a structural zero are left out.
+          if(structure && (is_zero(first) || is_zero(second)))
+          {
+            structural_flops += 2;
+            continue;
+          }
+          Value* &sum = accumulators[k % accumulators.size()];
+          sum = fmuladd(first,second,sum);
         }
-        row_vec.push_back(inner_product);
+        vec[i][j] = fast_math ? sum_terms(accumulators) : accumulators[0];
       }
-      vec.push_back(row_vec);
   }
-  std::string name = "temp";
-  matrices[name] = vec;
-  std::cout<<"Matrix product "<<name<<"\n";
-  return name;
+  return vec;
 }
-//Performs matrix determinant operation. Returns a Value* type and takes std::string type which is the 
-//matrix name for which this operation needs to be performed.
-Value* find_determinant(std::string mat_name)
+//Performs matrix determinant operation. Returns a Value* type and takes the matrix for which this operation
+//needs to be performed.
+Value* p1_context::find_determinant(matrix &mat)
 {
-  if(matrices[mat_name].size() == 1)
+  if(mat.rows == 1)
   {
-    return matrices[mat_name][0][0];
+    return unrolled(mat)[0][0];
   }
-  else if(matrices[mat_name].size() == 2)
+  else if(mat.rows == 2)
   {
-    Value *a = matrices[mat_name][0][0];
-    Value *b = matrices[mat_name][0][1];
-    Value *c = matrices[mat_name][1][0];
-    Value *d = matrices[mat_name][1][1];
+    Value *a = unrolled(mat)[0][0];
+    Value *b = unrolled(mat)[0][1];
+    Value *c = unrolled(mat)[1][0];
+    Value *d = unrolled(mat)[1][1];
 
-    return Builder.CreateFSub(Builder.CreateFMul(a,d),Builder.CreateFMul(b,c));
+    return fmulsub(b,c,fmul(a,d));
   }
-  else if(matrices[mat_name].size() == 3)
+  else if(mat.rows == 3)
   {
     
-    Value *a = Builder.CreateFMul(matrices[mat_name][1][1],matrices[mat_name][2][2]);
-    Value *b = Builder.CreateFMul(matrices[mat_name][2][1],matrices[mat_name][1][2]);
-
-    Value *c = Builder.CreateFMul(matrices[mat_name][1][0],matrices[mat_name][2][2]);
-    Value *d = Builder.CreateFMul(matrices[mat_name][2][0],matrices[mat_name][1][2]);
-
-    Value *e = Builder.CreateFMul(matrices[mat_name][1][0],matrices[mat_name][2][1]);
-    Value *f = Builder.CreateFMul(matrices[mat_name][2][0],matrices[mat_name][1][1]);
+    Value *a = fmul(unrolled(mat)[1][1],unrolled(mat)[2][2]);
+    Value *c = fmul(unrolled(mat)[1][0],unrolled(mat)[2][2]);
+    Value *e = fmul(unrolled(mat)[1][0],unrolled(mat)[2][1]);
 
-    Value *sub1 = Builder.CreateFSub(a,b);
-    Value *sub2 = Builder.CreateFSub(c,d);
-    Value *sub3 = Builder.CreateFSub(e,f);
+    Value *sub1 = fmulsub(unrolled(mat)[2][1],unrolled(mat)[1][2],a);
+    Value *sub2 = fmulsub(unrolled(mat)[2][0],unrolled(mat)[1][2],c);
+    Value *sub3 = fmulsub(unrolled(mat)[2][0],unrolled(mat)[1][1],e);
 
-    Value* det0 = Builder.CreateFMul(matrices[mat_name][0][0],sub1);
-    Value* det1 = Builder.CreateFMul(matrices[mat_name][0][1],sub2);
-    Value* det2 = Builder.CreateFMul(matrices[mat_name][0][2],sub3);
-
-    return Builder.CreateFAdd(Builder.CreateFSub(det0,det1),det2);
+    //det0 - det1 + det2 with the minors multiplied by their row 0 elements.
+    Value* det0 = fmul(unrolled(mat)[0][0],sub1);
+    return fmuladd(unrolled(mat)[0][2],sub3,fmulsub(unrolled(mat)[0][1],sub2,det0));
     
   }
-  else if(matrices[mat_name].size() == 4)
+  else if(mat.rows == 4)
   {
     //determinant of temps
-    Value *a = Builder.CreateFMul(matrices[mat_name][2][2],matrices[mat_name][3][3]);
-    Value *b = Builder.CreateFMul(matrices[mat_name][3][2],matrices[mat_name][2][3]);
-    Value *c = Builder.CreateFMul(matrices[mat_name][2][1],matrices[mat_name][3][3]);
-    Value *d = Builder.CreateFMul(matrices[mat_name][3][1],matrices[mat_name][2][3]);
-
-    Value *e = Builder.CreateFMul(matrices[mat_name][2][1],matrices[mat_name][3][2]);
-    Value *f = Builder.CreateFMul(matrices[mat_name][3][1],matrices[mat_name][2][2]);
-    Value *g = Builder.CreateFMul(matrices[mat_name][2][0],matrices[mat_name][3][3]);
-    Value *h = Builder.CreateFMul(matrices[mat_name][3][0],matrices[mat_name][2][3]);
-
-    Value *i = Builder.CreateFMul(matrices[mat_name][2][0],matrices[mat_name][3][2]);
-    Value *j = Builder.CreateFMul(matrices[mat_name][3][0],matrices[mat_name][2][2]);
-    // Value *k = Builder.CreateFMul(matrices[mat_name][3][1],matrices[mat_name][2][3]);
-    Value *l = Builder.CreateFMul(matrices[mat_name][2][0],matrices[mat_name][3][1]);
-
-    Value *m = Builder.CreateFMul(matrices[mat_name][3][0],matrices[mat_name][2][1]);
-
-    Value *sub1 = Builder.CreateFSub(a,b);
-    Value *sub2 = Builder.CreateFSub(c,d);
-    Value *sub3 = Builder.CreateFSub(e,f);
-    Value *sub4 = Builder.CreateFSub(g,h);
-    Value *sub5 = Builder.CreateFSub(i,j);
-    Value *sub6 = Builder.CreateFSub(l,m);
-
-    Value *det0 = Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(matrices[mat_name][1][1],sub1),Builder.CreateFMul(matrices[mat_name][1][2],sub2)),Builder.CreateFMul(matrices[mat_name][1][3],sub3));
-    Value *det1 = Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(matrices[mat_name][1][0],sub1),Builder.CreateFMul(matrices[mat_name][1][2],sub4)),Builder.CreateFMul(matrices[mat_name][1][3],sub5));
-    Value *det2 = Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(matrices[mat_name][1][0],sub2),Builder.CreateFMul(matrices[mat_name][1][1],sub4)),Builder.CreateFMul(matrices[mat_name][1][3],sub6));
-    Value *det3 = Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(matrices[mat_name][1][0],sub3),Builder.CreateFMul(matrices[mat_name][1][1],sub5)),Builder.CreateFMul(matrices[mat_name][1][2],sub6));
+    Value *a = fmul(unrolled(mat)[2][2],unrolled(mat)[3][3]);
+    Value *c = fmul(unrolled(mat)[2][1],unrolled(mat)[3][3]);
+    Value *e = fmul(unrolled(mat)[2][1],unrolled(mat)[3][2]);
+    Value *g = fmul(unrolled(mat)[2][0],unrolled(mat)[3][3]);
+    Value *i = fmul(unrolled(mat)[2][0],unrolled(mat)[3][2]);
+    Value *l = fmul(unrolled(mat)[2][0],unrolled(mat)[3][1]);
+
+    Value *sub1 = fmulsub(unrolled(mat)[3][2],unrolled(mat)[2][3],a);
+    Value *sub2 = fmulsub(unrolled(mat)[3][1],unrolled(mat)[2][3],c);
+    Value *sub3 = fmulsub(unrolled(mat)[3][1],unrolled(mat)[2][2],e);
+    Value *sub4 = fmulsub(unrolled(mat)[3][0],unrolled(mat)[2][3],g);
+    Value *sub5 = fmulsub(unrolled(mat)[3][0],unrolled(mat)[2][2],i);
+    Value *sub6 = fmulsub(unrolled(mat)[3][0],unrolled(mat)[2][1],l);
+
+    Value *det0 = fmuladd(unrolled(mat)[1][3],sub3,fmulsub(unrolled(mat)[1][2],sub2,fmul(unrolled(mat)[1][1],sub1)));
+    Value *det1 = fmuladd(unrolled(mat)[1][3],sub5,fmulsub(unrolled(mat)[1][2],sub4,fmul(unrolled(mat)[1][0],sub1)));
+    Value *det2 = fmuladd(unrolled(mat)[1][3],sub6,fmulsub(unrolled(mat)[1][1],sub4,fmul(unrolled(mat)[1][0],sub2)));
+    Value *det3 = fmuladd(unrolled(mat)[1][2],sub6,fmulsub(unrolled(mat)[1][1],sub5,fmul(unrolled(mat)[1][0],sub3)));
     
-    return Builder.CreateFSub(Builder.CreateFAdd(Builder.CreateFSub(det0,det1),det2),det3);
+    //Expanding along the first row, the minors above are multiplied by their row 0 elements.
+    Value *sum = fmul(unrolled(mat)[0][0],det0);
+    sum = fmulsub(unrolled(mat)[0][1],det1,sum);
+    sum = fmuladd(unrolled(mat)[0][2],det2,sum);
+    return fmulsub(unrolled(mat)[0][3],det3,sum);
   }
   else
   {
-    Value* a = matrices[mat_name][0][0];
-    yyerror("Error size > 4 won't work \n");
-    return a;
+    //Triangular matrices, e.g. identities, are known from their structure.
+    if(structure && is_triangular(mat))
+      return triangular_determinant(mat);
+    //Bigger matrices use the LU decomposition, O(n^3) instead of expanding the cofactors, done by libp1rt above the
+    //cutoff.
+    if(use_runtime(mat.rows))
+    {
+      to_storage(mat);
+      return call_runtime("p1rt_det",Builder.getFloatTy(),{mat.storage,Builder.getInt32(mat.rows)});
+    }
+    return lu_determinant(lu_decompose(mat,false));
   }
 
 }
@@ -204,7 +1960,7 @@ Value* find_determinant(std::string mat_name)
 %union {
   int num;
   float decimal;
-  char* variable_name;
+  int symbol;
   Value *val;
   rows2d* rows2dptr;
   rows* rowsptr;
@@ -213,6 +1969,45 @@ Value* find_determinant(std::string mat_name)
 
 %define parse.trace
 
+//Pure parser over a reentrant scanner, all the state of a compilation is in ctx.
+%define api.pure full
+%lex-param {yyscan_t scanner} {p1_context &ctx}
+%parse-param {yyscan_t scanner} {p1_context &ctx}
+
+%code requires {
+  typedef void* yyscan_t;
+  struct p1_context;
+
+  #include <vector>
+  #include "llvm/Support/Allocator.h"
+  namespace llvm { class Value; }
+
+  //Allocator of the vectors in the semantic values, their elements are kept in the arena of the compilation too.
+  template<typename T> struct arena_allocator
+  {
+    typedef T value_type;
+    llvm::BumpPtrAllocator *arena;
+    arena_allocator(llvm::BumpPtrAllocator &arena) : arena(&arena) {}
+    template<typename U> arena_allocator(const arena_allocator<U> &other) : arena(other.arena) {}
+    T* allocate(size_t n) { return arena->Allocate<T>(n); }
+    //The memory is released with the arena.
+    void deallocate(T*,size_t) {}
+    bool operator==(const arena_allocator &other) const { return arena == other.arena; }
+    bool operator!=(const arena_allocator &other) const { return arena != other.arena; }
+  };
+
+  //Type definition of 1D vector to pass the matrix to upper level rules of grammar.
+  typedef std::vector<llvm::Value*,arena_allocator<llvm::Value*>> rows;
+  //Type definition of 2D vector to pass the matrix to upper level rules of grammar.
+  typedef std::vector<rows*,arena_allocator<rows*>> rows2d;
+}
+
+%code {
+  int yylex(YYSTYPE *lvalp,yyscan_t scanner);
+  int yylex(YYSTYPE *lvalp,yyscan_t scanner,p1_context &ctx);
+  void yyerror(yyscan_t scanner,p1_context &ctx,const char* msg);
+}
+
 %token ERROR
 
 %token RETURN
@@ -224,7 +2019,7 @@ Value* find_determinant(std::string mat_name)
 
 %token <decimal> FLOAT
 %token <num> INT
-%token <variable_name> ID
+%token <symbol> ID
 
 %token SEMI COMMA
 
@@ -236,6 +2031,7 @@ Value* find_determinant(std::string mat_name)
 %token LBRACE RBRACE
 
 %type params_list
+%type param
 %type <vm> expr
 
 %type <rowsptr> expr_list
@@ -251,11 +2047,13 @@ Value* find_determinant(std::string mat_name)
 %%
 //Grammar rule for taking the function name of the code.
 program: ID {
+  ctx.reduced("program: ID");
   // FIXME: set name of function, this is okay, no need to change
-  funName = "main"; // FIXME: should not be main!
-  funName = $1;
+  ctx.funName = "main"; // FIXME: should not be main!
+  ctx.funName = ctx.symbol_names[$1];
 } LPAREN params_list_opt RPAREN LBRACE statements_opt return RBRACE //Grammar rule for taking the arguments, statements and return value (entire program).
 {
+  ctx.reduced("program: ID LPAREN params_list_opt RPAREN LBRACE statements_opt return RBRACE");
   // parsing is done, input is accepted
   YYACCEPT;
 }
@@ -264,70 +2062,96 @@ program: ID {
 //FIXME: some changes needed below
 params_list_opt:  params_list
 {
+  ctx.reduced("params_list_opt: params_list");
   // FIXME: This action needs attention!
-  // FIXME: this is hard-coded to be a single parameter:
-  std::vector<Type*> param_types(args_vec.size(),Builder.getFloatTy());
+  // Float parameters are floats, matrix parameters a pointer to the elements and the number of rows and columns.
+  std::vector<Type*> param_types;
+  for(auto dims: ctx.args_dims)
+  {
+    if(dims.first == 0)
+    {
+      param_types.push_back(ctx.Builder.getFloatTy());
+    }
+    else
+    {
+      param_types.push_back(PointerType::getUnqual(ctx.Builder.getFloatTy()));
+      param_types.push_back(ctx.Builder.getInt32Ty());
+      param_types.push_back(ctx.Builder.getInt32Ty());
+    }
+  }
   ArrayRef<Type*> Params (param_types);
 
   // Create int function type with no arguments
   FunctionType *FunType =
-    FunctionType::get(Builder.getFloatTy(),Params,false);
+    FunctionType::get(ctx.Builder.getFloatTy(),Params,false);
 
   // Create a main function
-  Function *Function = Function::Create(FunType,GlobalValue::ExternalLinkage,funName,M);
+  Function *Function = Function::Create(FunType,GlobalValue::ExternalLinkage,ctx.funName,ctx.M);
 
-  int arg_no=0;
-  //Maps the argument name to the values and stores them in the Variable_mapping vector for future use.
+  //The matrix arguments are only read.
   for(auto &a: Function->args()) {
-    //
-    // FIXME: match arguments to name in parameter list
-    // iterate over arguments of function
-    //
-
-    Variable_mappings[args_vec[arg_no]] = &a;
+    if(a.getType()->isPointerTy()) {
+      a.addAttr(Attribute::NoCapture);
+      a.addAttr(Attribute::ReadOnly);
+    }
+  }
 
-    std::cout<<"Bison params_list MAIN:"<<args_vec[arg_no]<<"\n";
-    arg_no++;
+  if(ctx.trace_parser) {
+    for(auto symbol: ctx.args_vec)
+      std::cout<<"Bison params_list MAIN:"<<ctx.symbol_names[symbol]<<"\n";
   }
 
-  //Add a basic block to main to hold instructions, and set Builder
-  //to insert there
-  Builder.SetInsertPoint(BasicBlock::Create(TheContext, "entry", Function));
+  //Maps the argument names to the values (or matrices) and adds the entry block, the Builder inserts into the body.
+  ctx.bind_arguments(Function);
 }
 | %empty
 {
+  ctx.reduced("params_list_opt: %empty");
   // Create int function type with no arguments
   FunctionType *FunType =
-    FunctionType::get(Builder.getFloatTy(),false);
+    FunctionType::get(ctx.Builder.getFloatTy(),false);
 
   // Create a main function
   Function *Function = Function::Create(FunType,
-         GlobalValue::ExternalLinkage,funName,M);
+         GlobalValue::ExternalLinkage,ctx.funName,ctx.M);
 
   //Add a basic block to main to hold instructions, and set Builder
   //to insert there
-  Builder.SetInsertPoint(BasicBlock::Create(TheContext, "entry", Function));
+  ctx.Builder.SetInsertPoint(BasicBlock::Create(ctx.TheContext, "entry", Function));
 }
 ;
 //Grammar rule for getting the arguments of the function.
-params_list: ID
-{
-  // FIXME: remember ID
-  args_vec.push_back($1);
-  std::cout<<args_vec[0]<<"\n";
+params_list: param { ctx.reduced("params_list: param"); }
+| params_list COMMA param { ctx.reduced("params_list: params_list COMMA param"); }
+;
 
+//Grammar rule for one argument, a float (a) or a matrix with its dimensions (m [3 x 3]).
+param: ID
+{
+  ctx.reduced("param: ID");
+  ctx.args_vec.push_back($1);
+  ctx.args_dims.push_back(std::make_pair(0,0));
+  if(ctx.trace_parser)
+    std::cout<<ctx.symbol_names[$1]<<"\n";
 }
-| params_list COMMA ID 
+| ID dim
 {
-  // FIXME: remember ID
-  args_vec.push_back($3);
+  ctx.reduced("param: ID dim");
+  ctx.args_vec.push_back($1);
+  ctx.args_dims.push_back(std::make_pair(ctx.dimensions[0],ctx.dimensions[1]));
+  if(ctx.trace_parser)
+    std::cout<<ctx.symbol_names[$1]<<" matrix\n";
 }
 ;
 //Grammar rule for performing return expression. It takes only float values and performs return.
 return: RETURN expr SEMI
 {
+  ctx.reduced("return: RETURN expr SEMI");
   if($2->is_var && $2->value != NULL)
-    Builder.CreateRet($2->value);
+  {
+    ctx.free_heap_storage();
+    ctx.Builder.CreateRet($2->value);
+  }
   else
   {
     yyerror("Return Value should be a varaible not a matrix or null type");
@@ -338,55 +2162,71 @@ return: RETURN expr SEMI
 ;
 
 // These may be fine without changes
-statements_opt: %empty
-            | statements
+statements_opt: %empty { ctx.reduced("statements_opt: %empty"); }
+            | statements { ctx.reduced("statements_opt: statements"); }
 ;
 
 // These may be fine without changes
-statements:   statement
-            | statements statement
+statements:   statement { ctx.reduced("statements: statement"); }
+            | statements statement { ctx.reduced("statements: statements statement"); }
 ;
 
 // Grammar rule for a = 2; Assginment of variable or immendiate or matrix type to another corresponding type.
 statement:
 ID ASSIGN expr SEMI
 {
+  ctx.reduced("statement: ID ASSIGN expr SEMI");
   if($3->is_var)
   {
-    Variable_mappings[$1] = $3->value;
-    mat_or_val[$1] = false;
+    ctx.Variable_mappings[$1] = $3->value;
+    ctx.mat_or_val[$1] = false;
   
   }
+  else if($3->mat == NULL)
+  {
+    yyerror("Assignment of an expression which is neither a scalar nor a matrix");
+    YYABORT;
+  }
   else
   {
-    matrices[$1] = matrices[$3->mat_name];
-    mat_or_val[$1] = true;
+    //The name is bound to the evaluated matrix, no elements are copied.
+    ctx.evaluate($3->mat);
+    ctx.matrices[$1] = $3->mat->value;
+    ctx.mat_or_val[$1] = true;
   }
 }
 //Grammar rule for a = m1 [2x2] {[1,0],[0,1]}; Assignment of matrix.
-//Stores the matrix in the map with the matrix name and corresponding 2d vector.
+//Stores the matrix in the matrix table and maps the matrix name to its handle.
 | ID ASSIGN MATRIX dim LBRACE matrix_rows RBRACE SEMI
 {
-  std::vector<std::vector<Value*> > temp;
-  for(const auto r: *$6)
+  ctx.reduced("statement: ID ASSIGN MATRIX dim LBRACE matrix_rows RBRACE SEMI");
+  matrix temp = make_matrix($6->size(),(*$6)[0]->size());
+  for(int i=0;i<temp.rows;i++)
   {
-    std::vector<Value*> temp_row;
-    for(const auto element: *r)
+    if((int)(*$6)[i]->size() != temp.cols)
+    {
+      yyerror("Matrix rows should have the same number of elements");
+      YYABORT;
+    }
+    for(int j=0;j<temp.cols;j++)
     {
-      temp_row.push_back(element);
+      temp[i][j] = (*(*$6)[i])[j];
     }
-    temp.push_back(temp_row);
   }
-  matrices[$1] = temp;
-  mat_or_val[$1] = true;
+  //Large matrices are stored into an array so the operations on them are generated with loops.
+  if(temp.rows*temp.cols > ctx.loop_threshold)
+    ctx.to_storage(temp);
+  ctx.matrices[$1] = ctx.new_matrix(std::move(temp));
+  ctx.mat_or_val[$1] = true;
 }
 ;
 
 // Grammar rule for [2x2], setting the dimension of the matrix;
 dim: LBRACKET INT X INT RBRACKET
 {
-  dimensions[0] = $2;
-  dimensions[1] = $4;
+  ctx.reduced("dim: LBRACKET INT X INT RBRACKET");
+  ctx.dimensions[0] = $2;
+  ctx.dimensions[1] = $4;
 }
 ;
 
@@ -394,12 +2234,14 @@ dim: LBRACKET INT X INT RBRACKET
 //Returns a pointer to rows2d type to upper level.
 matrix_rows: matrix_row
 {
-  rows2d *rptr = new rows2d();
+  ctx.reduced("matrix_rows: matrix_row");
+  rows2d *rptr = ctx.make<rows2d>(ctx.arena);
   rptr->push_back($1);
   $$ = rptr;
 }
 | matrix_rows COMMA matrix_row
 {
+  ctx.reduced("matrix_rows: matrix_rows COMMA matrix_row");
   $$->push_back($3);
 }
 ;
@@ -408,6 +2250,7 @@ matrix_rows: matrix_row
 //Returns a pointer to rows type to upper level.
 matrix_row: LBRACKET expr_list RBRACKET
 {
+  ctx.reduced("matrix_row: LBRACKET expr_list RBRACKET");
   $$ = $2;
 }
 ;
@@ -416,30 +2259,36 @@ matrix_row: LBRACKET expr_list RBRACKET
 //Returns a pointer to rows type to upper level.
 expr_list: expr
 {
+  ctx.reduced("expr_list: expr");
   if($1->is_var)
-    $$ = new rows({$1->value});
+  {
+    $$ = ctx.make<rows>(ctx.arena);
+    $$->push_back($1->value);
+  }
 }
 | expr_list COMMA expr
 {
+  ctx.reduced("expr_list: expr_list COMMA expr");
   if($3->is_var)
     $$->push_back($3->value);
 }
 ;
 
 //Grammar rule for getting the variable  or matrix name. 
-//Returns the value* type (which is thhe value) for variable and std::string type (matrix name) for matrices
+//Returns the value* type (which is thhe value) for variable and a matrix expression for matrices
 // to upper level.
 expr: ID
 {
-  $$ = new struct var_or_mat;
-  if(mat_or_val[$1] == false)
+  ctx.reduced("expr: ID");
+  $$ = ctx.make<var_or_mat>();
+  if(ctx.mat_or_val[$1] == false)
   {
-    $$->value =  Variable_mappings[$1];
+    $$->value =  ctx.Variable_mappings[$1];
     $$->is_var = true;
   }
   else
   {
-    $$->mat_name = $1;
+    $$->mat = ctx.leaf_expr(ctx.matrices[$1]);
     $$->is_var = false;
   }
 
@@ -447,483 +2296,488 @@ expr: ID
 //Grammar rule for getting the float value. Returns a Value* type (float value) to upper level.
 | FLOAT 
 {
+  ctx.reduced("expr: FLOAT");
   float f = $1;
-  Type *floatType = Type::getFloatTy(TheContext);
-  $$ = new struct var_or_mat;
+  Type *floatType = Type::getFloatTy(ctx.TheContext);
+  $$ = ctx.make<var_or_mat>();
   $$->value = ConstantFP::get(floatType, f);
   $$->is_var = true;
 }
 //Grammar rule for getting the int value. Returns a Value* type (int value) to upper level.
 | INT 
 {
-  Value* temp_val = Builder.CreateUIToFP(Builder.getInt32($1),Builder.getFloatTy());
-  $$ = new struct var_or_mat;
-  $$->value = temp_val;
+  ctx.reduced("expr: INT");
+  $$ = ctx.make<var_or_mat>();
+  $$->value = ConstantFP::get(ctx.Builder.getFloatTy(),(float)$1);
   $$->is_var = true;
 }
 //Grammar rule for computing the addition of variable or matrices. Returns a Value* type for variables
-// and std::string type matrix name for matrices to upper level.
+// and a matrix expression for matrices to upper level.
 | expr PLUS expr 
 {
-  $$ = new struct var_or_mat;
+  ctx.reduced("expr: expr PLUS expr");
+  $$ = ctx.make<var_or_mat>();
   if($1->is_var && $3->is_var)
   {
-      $$->value = Builder.CreateFAdd($1->value,$3->value);
+      $$->value = ctx.fadd($1->value,$3->value);
       $$->is_var = true;
   }
   else if($1->is_var==false && $3->is_var==false)
   {
   
-    if(matrices[$1->mat_name].size() != matrices[$3->mat_name].size())
+    if($1->mat->rows != $3->mat->rows)
     {
       yyerror("Bison Matrix Addition row dimension error\n");  
       YYABORT;
     }
-    for(int i=0;i<matrices[$1->mat_name].size();i++)
+    if($1->mat->cols != $3->mat->cols)
     {
-      if(matrices[$1->mat_name][i].size() != matrices[$3->mat_name][i].size())
-      {
-        yyerror("Bison Matrix Addition row dimension error\n");
-        YYABORT;
-      }
+      yyerror("Bison Matrix Addition row dimension error\n");
+      YYABORT;
     }
 
-    //performing matrix addition
-    std::vector<std::vector<Value*>> temp;
-    for(int i=0;i<matrices[$1->mat_name].size();i++)
-    {
-      std::vector<Value*> temp_row;
-      for(int j=0;j<matrices[$1->mat_name][i].size();j++)
-      {
-        temp_row.push_back(Builder.CreateFAdd(matrices[$1->mat_name][i][j] , matrices[$3->mat_name][i][j]));
-      }
-      temp.push_back(temp_row);
-    }
-    matrices["temp"] = temp;
-    $$->mat_name = "temp";
+    //The addition is only recorded, it is evaluated together with the rest of the expression.
+    $$->mat = ctx.elementwise_expr(MAT_ADD,$1->mat,$3->mat,NULL);
     $$->is_var = false;
   }
+  else
+  {
+    yyerror("Matrix and scalar can't be added");
+    YYABORT;
+  }
 }
 //Grammar rule for performing subtraction of 2 variables or matrices. Returns a Value* type for variables 
-//or a std::string type of matrix name for matrices to upper level.
+//or a matrix expression for matrices to upper level.
 | expr MINUS expr
 {
-  $$ = new struct var_or_mat;
+  ctx.reduced("expr: expr MINUS expr");
+  $$ = ctx.make<var_or_mat>();
   if($1->is_var && $3->is_var)
   {
-    $$->value = Builder.CreateFSub($1->value,$3->value);
+    $$->value = ctx.fsub($1->value,$3->value);
     $$->is_var = true;
   }
   else if($1->is_var==false && $3->is_var==false)
   {
-    if(matrices[$1->mat_name].size() != matrices[$3->mat_name].size())
+    if($1->mat->rows != $3->mat->rows || $1->mat->cols != $3->mat->cols)
     {
       yyerror("Bison Matrix Subtraction row dimension error\n");
       YYABORT;
     }
 
-    std::vector<std::vector<Value*>> temp;
-    for(int i=0;i<matrices[$1->mat_name].size();i++)
-    {
-      std::vector<Value*> temp_row;
-      for(int j=0;j<matrices[$1->mat_name][i].size();j++)
-      {
-        temp_row.push_back(Builder.CreateFSub(matrices[$1->mat_name][i][j] , matrices[$3->mat_name][i][j]));
-      }
-      temp.push_back(temp_row);
-    }
-      matrices["temp"] = temp;
-      $$->mat_name = "temp";
-      $$->is_var = false;
+    $$->mat = ctx.elementwise_expr(MAT_SUB,$1->mat,$3->mat,NULL);
+    $$->is_var = false;
+  }
+  else
+  {
+    yyerror("Matrix and scalar can't be subtracted");
+    YYABORT;
   }
 }
 //Grammar rule for performing multiplication of 2 variables or matrices or a matrix and variable. Returns a Value* type for variables 
-//or a std::string type of matrix name for matrices to upper level.  
+//or a matrix expression for matrices to upper level.  
 | expr MUL expr
 {
-  $$ = new struct var_or_mat;
+  ctx.reduced("expr: expr MUL expr");
+  $$ = ctx.make<var_or_mat>();
   if($1->is_var && $3->is_var)
   {
-    $$->value = Builder.CreateFMul($1->value,$3->value);
+    $$->value = ctx.fmul($1->value,$3->value);
     $$->is_var = true;
   }
   else if(!$1->is_var && !$3->is_var)
   {
-    std::string name = matrix_product($1->mat_name,$3->mat_name);
-    if(name == "error")
+    if($1->mat->cols != $3->mat->rows)
+    {
+      // If the matrix product size rules doesn't match, it aborts.
+      yyerror("Matrix multiplication dimension error\n");
       YYABORT;
+    }
+    //The product is only recorded, the products of a chain are evaluated together in the cheapest order.
     $$->is_var = false;
-    $$->mat_name = name;
+    $$->mat = ctx.product_expr($1->mat,$3->mat);
   }
   else if(!$1->is_var && $3->is_var)
   {
-    std::vector<std::vector<Value*> > mat = matrices[$1->mat_name];
-    Value* mul = $3->value;
-    
-    for(int i=0;i<mat.size();i++)
-    {
-      for(int j=0;j<mat[i].size();j++)
-      {
-        mat[i][j] = Builder.CreateFMul(matrices[$1->mat_name][i][j],mul);  
-      }
-    }
-    
-    matrices["temp"] = mat;
     $$->is_var = false;
-    $$->mat_name = "temp";
+    $$->mat = ctx.elementwise_expr(MAT_SCALE,$1->mat,NULL,$3->value);
   }
   else if($1->is_var && !$3->is_var)
   {
-    std::vector<std::vector<Value*> > mat = matrices[$3->mat_name];
-    Value* mul = $1->value;
-    
-    for(int i=0;i<mat.size();i++)
-    {
-      for(int j=0;j<mat[i].size();j++)
-      {
-        mat[i][j] = Builder.CreateFMul(matrices[$1->mat_name][i][j],mul);  
-      }
-    }
-    
-    matrices["temp"] = mat;
     $$->is_var = false;
-    $$->mat_name = "temp";
+    $$->mat = ctx.elementwise_expr(MAT_SCALE,$3->mat,NULL,$1->value);
   }
     
 }
 //Grammar rule for performing division of 2 variables or matrices or matrix and variable. Returns a Value* type for variables 
-//or a std::string type of matrix name for matrices to upper level.
+//or a matrix expression for matrices to upper level.
 | expr DIV expr
 {
-  $$ = new struct var_or_mat;
+  ctx.reduced("expr: expr DIV expr");
+  $$ = ctx.make<var_or_mat>();
   if($1->is_var && $3->is_var)
   {
-    $$->value = Builder.CreateFDiv($1->value,$3->value);
+    $$->value = ctx.fdiv($1->value,$3->value);
     $$->is_var = true;
   }
   else if(!$1->is_var && $3->is_var)
   {
-    std::vector<std::vector<Value*> > mat = matrices[$1->mat_name];
-    Value* div = $3->value;
-    
-    for(int i=0;i<mat.size();i++)
-    {
-      for(int j=0;j<mat[i].size();j++)
-      {
-      
-        mat[i][j] = Builder.CreateFDiv(matrices[$1->mat_name][i][j],div);
-          
-      }
-    }
-    
-    matrices["temp"] = mat;
     $$->is_var = false;
-    $$->mat_name = "temp";
+    $$->mat = ctx.elementwise_expr(MAT_DIVIDE,$1->mat,NULL,$3->value);
+  }
+  else if($1->is_var && !$3->is_var)
+  {
+    yyerror("Scalar can't be divided by a matrix");
+    YYABORT;
   }
   else if(!$1->is_var && !$3->is_var)  
   {
-    //Matrix division for 2x2, 3x3 and 4x4
-    std::vector<std::vector<Value*> > mat1 = matrices[$1->mat_name];
-    std::vector<std::vector<Value*> > mat2 = matrices[$3->mat_name];
-
-    //Inverse of second matrix
-    if(mat2.size() == 2)
-    {
-      Value *det = find_determinant($3->mat_name);
-      mat2[0][0] = Builder.CreateFDiv(matrices[$3->mat_name][1][1],det);
-      mat2[0][1] = Builder.CreateFDiv(Builder.CreateFNeg(matrices[$3->mat_name][0][1]),det);
-      mat2[1][0] = Builder.CreateFDiv(Builder.CreateFNeg(matrices[$3->mat_name][1][0]),det);
-      mat2[1][1] = Builder.CreateFDiv(matrices[$3->mat_name][0][0],det);
-    }
-    else if(mat2.size() == 3)
-    {
-      Value *det = find_determinant($3->mat_name);
-      Value* one = ConstantFP::get(Type::getFloatTy(TheContext), 1.0);
-      Value *inv_det = Builder.CreateFDiv(one,det);
-      mat2[0][0] = Builder.CreateFMul(inv_det,Builder.CreateFSub(Builder.CreateFMul(matrices[$3->mat_name][1][1],matrices[$3->mat_name][2][2]),Builder.CreateFMul(matrices[$3->mat_name][2][1],matrices[$3->mat_name][1][2])));
-      mat2[0][1] = Builder.CreateFMul(inv_det,Builder.CreateFSub(Builder.CreateFMul(matrices[$3->mat_name][0][2],matrices[$3->mat_name][2][1]),Builder.CreateFMul(matrices[$3->mat_name][0][1],matrices[$3->mat_name][2][2])));
-      mat2[0][2] = Builder.CreateFMul(inv_det,Builder.CreateFSub(Builder.CreateFMul(matrices[$3->mat_name][0][1],matrices[$3->mat_name][1][2]),Builder.CreateFMul(matrices[$3->mat_name][0][2],matrices[$3->mat_name][1][1])));
-
-      mat2[1][0] = Builder.CreateFMul(inv_det,Builder.CreateFSub(Builder.CreateFMul(matrices[$3->mat_name][1][2],matrices[$3->mat_name][2][0]),Builder.CreateFMul(matrices[$3->mat_name][1][0],matrices[$3->mat_name][2][2])));
-      mat2[1][1] = Builder.CreateFMul(inv_det,Builder.CreateFSub(Builder.CreateFMul(matrices[$3->mat_name][0][0],matrices[$3->mat_name][2][2]),Builder.CreateFMul(matrices[$3->mat_name][0][2],matrices[$3->mat_name][2][0])));
-      mat2[1][2] = Builder.CreateFMul(inv_det,Builder.CreateFSub(Builder.CreateFMul(matrices[$3->mat_name][1][0],matrices[$3->mat_name][0][2]),Builder.CreateFMul(matrices[$3->mat_name][0][0],matrices[$3->mat_name][1][2])));
-
-      mat2[2][0] = Builder.CreateFMul(inv_det,Builder.CreateFSub(Builder.CreateFMul(matrices[$3->mat_name][1][0],matrices[$3->mat_name][2][1]),Builder.CreateFMul(matrices[$3->mat_name][2][0],matrices[$3->mat_name][1][1])));
-      mat2[2][1] = Builder.CreateFMul(inv_det,Builder.CreateFSub(Builder.CreateFMul(matrices[$3->mat_name][2][0],matrices[$3->mat_name][0][1]),Builder.CreateFMul(matrices[$3->mat_name][0][0],matrices[$3->mat_name][2][1])));
-      mat2[2][2] = Builder.CreateFMul(inv_det,Builder.CreateFSub(Builder.CreateFMul(matrices[$3->mat_name][0][0],matrices[$3->mat_name][1][1]),Builder.CreateFMul(matrices[$3->mat_name][1][0],matrices[$3->mat_name][0][1])));
-    }
-    else if(mat2.size() == 4)
-    {
-      //Algorithm referenced from stackoverflow https://stackoverflow.com/questions/1148309/inverting-a-4x4-matrix?rq=1
-      Value* m00 = matrices[$3->mat_name][0][0];
-      Value* m01 = matrices[$3->mat_name][0][1];
-      Value* m02 = matrices[$3->mat_name][0][2];
-      Value* m03 = matrices[$3->mat_name][0][3];
-
-      Value* m10 = matrices[$3->mat_name][1][0];
-      Value* m11 = matrices[$3->mat_name][1][1];
-      Value* m12 = matrices[$3->mat_name][1][2];
-      Value* m13 = matrices[$3->mat_name][1][3];
-
-      Value* m20 = matrices[$3->mat_name][2][0];
-      Value* m21 = matrices[$3->mat_name][2][1];
-      Value* m22 = matrices[$3->mat_name][2][2];
-      Value* m23 = matrices[$3->mat_name][2][3];
-
-      Value* m30 = matrices[$3->mat_name][3][0];
-      Value* m31 = matrices[$3->mat_name][3][1];
-      Value* m32 = matrices[$3->mat_name][3][2];
-      Value* m33 = matrices[$3->mat_name][3][3];
-
-      Value* A2323 = Builder.CreateFSub(Builder.CreateFMul(m22,m33),Builder.CreateFMul(m23,m32));
-      Value* A1323 = Builder.CreateFSub(Builder.CreateFMul(m21,m33),Builder.CreateFMul(m23,m31));
-      Value* A1223 = Builder.CreateFSub(Builder.CreateFMul(m21,m32),Builder.CreateFMul(m22,m31));
-      Value* A0323 = Builder.CreateFSub(Builder.CreateFMul(m20,m33),Builder.CreateFMul(m23,m30));
-      Value* A0223 = Builder.CreateFSub(Builder.CreateFMul(m20,m32),Builder.CreateFMul(m22,m30));
-      Value* A0123 = Builder.CreateFSub(Builder.CreateFMul(m20,m31),Builder.CreateFMul(m21,m30));
-      Value* A2313 = Builder.CreateFSub(Builder.CreateFMul(m12,m33),Builder.CreateFMul(m13,m32));
-      Value* A1313 = Builder.CreateFSub(Builder.CreateFMul(m11,m33),Builder.CreateFMul(m13,m31));
-      Value* A1213 = Builder.CreateFSub(Builder.CreateFMul(m11,m32),Builder.CreateFMul(m12,m31));
-      Value* A2312 = Builder.CreateFSub(Builder.CreateFMul(m12,m23),Builder.CreateFMul(m13,m22));
-      Value* A1312 = Builder.CreateFSub(Builder.CreateFMul(m11,m23),Builder.CreateFMul(m13,m21));
-      Value* A1212 = Builder.CreateFSub(Builder.CreateFMul(m11,m22),Builder.CreateFMul(m12,m21));
-      Value* A0313 = Builder.CreateFSub(Builder.CreateFMul(m10,m33),Builder.CreateFMul(m13,m30));
-      Value* A0213 = Builder.CreateFSub(Builder.CreateFMul(m10,m32),Builder.CreateFMul(m12,m30));
-      Value* A0312 = Builder.CreateFSub(Builder.CreateFMul(m10,m23),Builder.CreateFMul(m13,m20));
-      Value* A0212 = Builder.CreateFSub(Builder.CreateFMul(m10,m22),Builder.CreateFMul(m12,m20));
-      Value* A0113 = Builder.CreateFSub(Builder.CreateFMul(m10,m31),Builder.CreateFMul(m11,m30));
-      Value* A0112 = Builder.CreateFSub(Builder.CreateFMul(m10,m21),Builder.CreateFMul(m11,m20));
-
-      Value *det = find_determinant($3->mat_name);
-      Value* one = ConstantFP::get(Type::getFloatTy(TheContext), 1.0);
-      Value *inv_det = Builder.CreateFDiv(one,det);
-
-      mat2[0][0] = Builder.CreateFMul(inv_det ,Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m11 , A2323) , Builder.CreateFMul(m12 , A1323)) , Builder.CreateFMul(m13 , A1223)));
-      mat2[0][1] = Builder.CreateFMul(inv_det ,Builder.CreateFNeg(Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m01 , A2323) , Builder.CreateFMul(m02 , A1323)) , Builder.CreateFMul(m03 , A1223))));
-      mat2[0][2] = Builder.CreateFMul(inv_det ,Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m01 , A2313) , Builder.CreateFMul(m02 , A1313)) , Builder.CreateFMul(m03 , A1213)));
-      mat2[0][3] = Builder.CreateFMul(inv_det ,Builder.CreateFNeg(Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m01 , A2312) , Builder.CreateFMul(m02 , A1312)) , Builder.CreateFMul(m03 , A1212))));
-      mat2[1][0] = Builder.CreateFMul(inv_det ,Builder.CreateFNeg(Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m10 , A2323) , Builder.CreateFMul(m12 , A0323)) , Builder.CreateFMul(m13 , A0223))));
-      mat2[1][1] = Builder.CreateFMul(inv_det ,Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m00 , A2323) , Builder.CreateFMul(m02 , A0323)) , Builder.CreateFMul(m03 , A0223)));
-      mat2[1][2] = Builder.CreateFMul(inv_det ,Builder.CreateFNeg(Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m00 , A2313) , Builder.CreateFMul(m02 , A0313)) , Builder.CreateFMul(m03 , A0213))));
-      mat2[1][3] = Builder.CreateFMul(inv_det ,Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m00 , A2312) , Builder.CreateFMul(m02 , A0312)) , Builder.CreateFMul(m03 , A0212)));
-      mat2[2][0] = Builder.CreateFMul(inv_det ,Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m10 , A1323) , Builder.CreateFMul(m11 , A0323)) , Builder.CreateFMul(m13 , A0123)));
-      mat2[2][1] = Builder.CreateFMul(inv_det ,Builder.CreateFNeg(Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m00 , A1323) , Builder.CreateFMul(m01 , A0323)) , Builder.CreateFMul(m03 , A0123))));
-      mat2[2][2] = Builder.CreateFMul(inv_det ,Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m00 , A1313) , Builder.CreateFMul(m01 , A0313)) , Builder.CreateFMul(m03 , A0113)));
-      mat2[2][3] = Builder.CreateFMul(inv_det ,Builder.CreateFNeg(Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m00 , A1312) , Builder.CreateFMul(m01 , A0312)) , Builder.CreateFMul(m03 , A0112))));
-      mat2[3][0] = Builder.CreateFMul(inv_det ,Builder.CreateFNeg(Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m10 , A1223) , Builder.CreateFMul(m11 , A0223)) , Builder.CreateFMul(m12 , A0123))));
-      mat2[3][1] = Builder.CreateFMul(inv_det ,Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m00 , A1223) , Builder.CreateFMul(m01 , A0223)) , Builder.CreateFMul(m02 , A0123)));
-      mat2[3][2] = Builder.CreateFMul(inv_det ,Builder.CreateFNeg(Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m00 , A1213) , Builder.CreateFMul(m01 , A0213)) , Builder.CreateFMul(m02 , A0113))));
-      mat2[3][3] = Builder.CreateFMul(inv_det ,Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m00 , A1212) , Builder.CreateFMul(m01 , A0212)) , Builder.CreateFMul(m02 , A0112)));
-    }
-    else
+    if($3->mat->rows != $3->mat->cols || $1->mat->cols != $3->mat->rows)
     {
-      yyerror("Size of matrix is more than 4, requires size to be less than or equal to 4\n");
+      yyerror("Matrix division dimension error\n");
       YYABORT;
     }
+    matrix &a = ctx.evaluate($1->mat);
+    matrix &b = ctx.evaluate($3->mat);
+    //The inverse is written out in closed form for 2x2, 3x3 and 4x4 divisors only, the others (1x1 too) are handled
+    //with the LU decomposition and substitution instead of forming the inverse.
+    if(b.rows < 2 || b.rows > 4)
+    {
+      $$->is_var = false;
+      $$->mat = ctx.result_expr(ctx.divide_loop(a,b));
+    }
+    else
+    {
+      //Matrix division for 2x2, 3x3 and 4x4
+      matrix mat2 = make_matrix(b.rows,b.cols);
 
-    //Finding product
-    matrices["inverted"] = mat2;
-    std::string name = matrix_product($1->mat_name,"inverted");
-    if(name == "error")
-      YYABORT;
-    $$->is_var = false;
-    $$->mat_name = name;
+      //Inverse of second matrix
+      if(mat2.rows == 2)
+      {
+        Value *det = ctx.find_determinant(b);
+        mat2[0][0] = ctx.fdiv(ctx.unrolled(b)[1][1],det);
+        mat2[0][1] = ctx.fdiv(ctx.fneg(ctx.unrolled(b)[0][1]),det);
+        mat2[1][0] = ctx.fdiv(ctx.fneg(ctx.unrolled(b)[1][0]),det);
+        mat2[1][1] = ctx.fdiv(ctx.unrolled(b)[0][0],det);
+      }
+      else if(mat2.rows == 3)
+      {
+        Value *det = ctx.find_determinant(b);
+        Value* one = ConstantFP::get(Type::getFloatTy(ctx.TheContext), 1.0);
+        Value *inv_det = ctx.fdiv(one,det);
+        mat2[0][0] = ctx.fmul(inv_det,ctx.fsub(ctx.fmul(ctx.unrolled(b)[1][1],ctx.unrolled(b)[2][2]),ctx.fmul(ctx.unrolled(b)[2][1],ctx.unrolled(b)[1][2])));
+        mat2[0][1] = ctx.fmul(inv_det,ctx.fsub(ctx.fmul(ctx.unrolled(b)[0][2],ctx.unrolled(b)[2][1]),ctx.fmul(ctx.unrolled(b)[0][1],ctx.unrolled(b)[2][2])));
+        mat2[0][2] = ctx.fmul(inv_det,ctx.fsub(ctx.fmul(ctx.unrolled(b)[0][1],ctx.unrolled(b)[1][2]),ctx.fmul(ctx.unrolled(b)[0][2],ctx.unrolled(b)[1][1])));
+
+        mat2[1][0] = ctx.fmul(inv_det,ctx.fsub(ctx.fmul(ctx.unrolled(b)[1][2],ctx.unrolled(b)[2][0]),ctx.fmul(ctx.unrolled(b)[1][0],ctx.unrolled(b)[2][2])));
+        mat2[1][1] = ctx.fmul(inv_det,ctx.fsub(ctx.fmul(ctx.unrolled(b)[0][0],ctx.unrolled(b)[2][2]),ctx.fmul(ctx.unrolled(b)[0][2],ctx.unrolled(b)[2][0])));
+        mat2[1][2] = ctx.fmul(inv_det,ctx.fsub(ctx.fmul(ctx.unrolled(b)[1][0],ctx.unrolled(b)[0][2]),ctx.fmul(ctx.unrolled(b)[0][0],ctx.unrolled(b)[1][2])));
+
+        mat2[2][0] = ctx.fmul(inv_det,ctx.fsub(ctx.fmul(ctx.unrolled(b)[1][0],ctx.unrolled(b)[2][1]),ctx.fmul(ctx.unrolled(b)[2][0],ctx.unrolled(b)[1][1])));
+        mat2[2][1] = ctx.fmul(inv_det,ctx.fsub(ctx.fmul(ctx.unrolled(b)[2][0],ctx.unrolled(b)[0][1]),ctx.fmul(ctx.unrolled(b)[0][0],ctx.unrolled(b)[2][1])));
+        mat2[2][2] = ctx.fmul(inv_det,ctx.fsub(ctx.fmul(ctx.unrolled(b)[0][0],ctx.unrolled(b)[1][1]),ctx.fmul(ctx.unrolled(b)[1][0],ctx.unrolled(b)[0][1])));
+      }
+      else if(mat2.rows == 4)
+      {
+        //Algorithm referenced from stackoverflow https://stackoverflow.com/questions/1148309/inverting-a-4x4-matrix?rq=1
+        Value* m00 = ctx.unrolled(b)[0][0];
+        Value* m01 = ctx.unrolled(b)[0][1];
+        Value* m02 = ctx.unrolled(b)[0][2];
+        Value* m03 = ctx.unrolled(b)[0][3];
+
+        Value* m10 = ctx.unrolled(b)[1][0];
+        Value* m11 = ctx.unrolled(b)[1][1];
+        Value* m12 = ctx.unrolled(b)[1][2];
+        Value* m13 = ctx.unrolled(b)[1][3];
+
+        Value* m20 = ctx.unrolled(b)[2][0];
+        Value* m21 = ctx.unrolled(b)[2][1];
+        Value* m22 = ctx.unrolled(b)[2][2];
+        Value* m23 = ctx.unrolled(b)[2][3];
+
+        Value* m30 = ctx.unrolled(b)[3][0];
+        Value* m31 = ctx.unrolled(b)[3][1];
+        Value* m32 = ctx.unrolled(b)[3][2];
+        Value* m33 = ctx.unrolled(b)[3][3];
+
+        Value* A2323 = ctx.fsub(ctx.fmul(m22,m33),ctx.fmul(m23,m32));
+        Value* A1323 = ctx.fsub(ctx.fmul(m21,m33),ctx.fmul(m23,m31));
+        Value* A1223 = ctx.fsub(ctx.fmul(m21,m32),ctx.fmul(m22,m31));
+        Value* A0323 = ctx.fsub(ctx.fmul(m20,m33),ctx.fmul(m23,m30));
+        Value* A0223 = ctx.fsub(ctx.fmul(m20,m32),ctx.fmul(m22,m30));
+        Value* A0123 = ctx.fsub(ctx.fmul(m20,m31),ctx.fmul(m21,m30));
+        Value* A2313 = ctx.fsub(ctx.fmul(m12,m33),ctx.fmul(m13,m32));
+        Value* A1313 = ctx.fsub(ctx.fmul(m11,m33),ctx.fmul(m13,m31));
+        Value* A1213 = ctx.fsub(ctx.fmul(m11,m32),ctx.fmul(m12,m31));
+        Value* A2312 = ctx.fsub(ctx.fmul(m12,m23),ctx.fmul(m13,m22));
+        Value* A1312 = ctx.fsub(ctx.fmul(m11,m23),ctx.fmul(m13,m21));
+        Value* A1212 = ctx.fsub(ctx.fmul(m11,m22),ctx.fmul(m12,m21));
+        Value* A0313 = ctx.fsub(ctx.fmul(m10,m33),ctx.fmul(m13,m30));
+        Value* A0213 = ctx.fsub(ctx.fmul(m10,m32),ctx.fmul(m12,m30));
+        Value* A0312 = ctx.fsub(ctx.fmul(m10,m23),ctx.fmul(m13,m20));
+        Value* A0212 = ctx.fsub(ctx.fmul(m10,m22),ctx.fmul(m12,m20));
+        Value* A0113 = ctx.fsub(ctx.fmul(m10,m31),ctx.fmul(m11,m30));
+        Value* A0112 = ctx.fsub(ctx.fmul(m10,m21),ctx.fmul(m11,m20));
+
+        Value *det = ctx.find_determinant(b);
+        Value* one = ConstantFP::get(Type::getFloatTy(ctx.TheContext), 1.0);
+        Value *inv_det = ctx.fdiv(one,det);
+
+        mat2[0][0] = ctx.fmul(inv_det ,ctx.fadd(ctx.fsub(ctx.fmul(m11 , A2323) , ctx.fmul(m12 , A1323)) , ctx.fmul(m13 , A1223)));
+        mat2[0][1] = ctx.fmul(inv_det ,ctx.fneg(ctx.fadd(ctx.fsub(ctx.fmul(m01 , A2323) , ctx.fmul(m02 , A1323)) , ctx.fmul(m03 , A1223))));
+        mat2[0][2] = ctx.fmul(inv_det ,ctx.fadd(ctx.fsub(ctx.fmul(m01 , A2313) , ctx.fmul(m02 , A1313)) , ctx.fmul(m03 , A1213)));
+        mat2[0][3] = ctx.fmul(inv_det ,ctx.fneg(ctx.fadd(ctx.fsub(ctx.fmul(m01 , A2312) , ctx.fmul(m02 , A1312)) , ctx.fmul(m03 , A1212))));
+        mat2[1][0] = ctx.fmul(inv_det ,ctx.fneg(ctx.fadd(ctx.fsub(ctx.fmul(m10 , A2323) , ctx.fmul(m12 , A0323)) , ctx.fmul(m13 , A0223))));
+        mat2[1][1] = ctx.fmul(inv_det ,ctx.fadd(ctx.fsub(ctx.fmul(m00 , A2323) , ctx.fmul(m02 , A0323)) , ctx.fmul(m03 , A0223)));
+        mat2[1][2] = ctx.fmul(inv_det ,ctx.fneg(ctx.fadd(ctx.fsub(ctx.fmul(m00 , A2313) , ctx.fmul(m02 , A0313)) , ctx.fmul(m03 , A0213))));
+        mat2[1][3] = ctx.fmul(inv_det ,ctx.fadd(ctx.fsub(ctx.fmul(m00 , A2312) , ctx.fmul(m02 , A0312)) , ctx.fmul(m03 , A0212)));
+        mat2[2][0] = ctx.fmul(inv_det ,ctx.fadd(ctx.fsub(ctx.fmul(m10 , A1323) , ctx.fmul(m11 , A0323)) , ctx.fmul(m13 , A0123)));
+        mat2[2][1] = ctx.fmul(inv_det ,ctx.fneg(ctx.fadd(ctx.fsub(ctx.fmul(m00 , A1323) , ctx.fmul(m01 , A0323)) , ctx.fmul(m03 , A0123))));
+        mat2[2][2] = ctx.fmul(inv_det ,ctx.fadd(ctx.fsub(ctx.fmul(m00 , A1313) , ctx.fmul(m01 , A0313)) , ctx.fmul(m03 , A0113)));
+        mat2[2][3] = ctx.fmul(inv_det ,ctx.fneg(ctx.fadd(ctx.fsub(ctx.fmul(m00 , A1312) , ctx.fmul(m01 , A0312)) , ctx.fmul(m03 , A0112))));
+        mat2[3][0] = ctx.fmul(inv_det ,ctx.fneg(ctx.fadd(ctx.fsub(ctx.fmul(m10 , A1223) , ctx.fmul(m11 , A0223)) , ctx.fmul(m12 , A0123))));
+        mat2[3][1] = ctx.fmul(inv_det ,ctx.fadd(ctx.fsub(ctx.fmul(m00 , A1223) , ctx.fmul(m01 , A0223)) , ctx.fmul(m02 , A0123)));
+        mat2[3][2] = ctx.fmul(inv_det ,ctx.fneg(ctx.fadd(ctx.fsub(ctx.fmul(m00 , A1213) , ctx.fmul(m01 , A0213)) , ctx.fmul(m02 , A0113))));
+        mat2[3][3] = ctx.fmul(inv_det ,ctx.fadd(ctx.fsub(ctx.fmul(m00 , A1212) , ctx.fmul(m01 , A0212)) , ctx.fmul(m02 , A0112)));
+      }
+
+      //Finding product
+      $$->is_var = false;
+      $$->mat = ctx.result_expr(ctx.matrix_product(a,mat2));
+    }
 
   }
 }
 //Grammar rule for performing negation of 2 variables or matrices. Returns a Value* type for variables 
-//or a std::string type of matrix name for matrices to upper level.
+//or a matrix expression for matrices to upper level.
 | MINUS expr
 {
-  $$ = new struct var_or_mat;
+  ctx.reduced("expr: MINUS expr");
+  $$ = ctx.make<var_or_mat>();
   if($2->is_var)
   {
-    $$->value = Builder.CreateFNeg($2->value);
+    $$->value = ctx.fneg($2->value);
     $$->is_var = true;
   }
   else
   {
-    std::vector<std::vector<Value*> > mat = matrices[$2->mat_name];
-    for(int i=0;i<mat.size();i++)
-    {
-      for(int j=0;j<mat[i].size();j++)
-      {
-        mat[i][j] = Builder.CreateFNeg(mat[i][j]);
-      }
-    }
-    matrices["temp"] = mat;
     $$->is_var = false;
-    $$->mat_name = "temp";
+    $$->mat = ctx.elementwise_expr(MAT_NEGATE,$2->mat,NULL,NULL);
   }
 }
 //Grammar rule for performing the determinant operation of a matrix. Returns a Value* type (float value)
 //to upper level.
 | DET LPAREN expr RPAREN
 {
-  $$ = new struct var_or_mat;
-  if(matrices[$3->mat_name].size() != matrices[$3->mat_name][0].size())
+  ctx.reduced("expr: DET LPAREN expr RPAREN");
+  $$ = ctx.make<var_or_mat>();
+  if($3->is_var)
+  {
+    yyerror("Determinant can't be taken for a scalar");
+    YYABORT;
+  }
+  matrix &a = ctx.evaluate($3->mat);
+  if(a.rows != a.cols)
   {
     yyerror("Determinant can't be taken for non square matrix");
     YYABORT;
   }
-  $$->value = find_determinant($3->mat_name);
+  $$->value = ctx.find_determinant(a);
   $$->is_var = true;
 }
-//Grammar rule for finding the inverse of a matrix. Returns a std::string type (matrix name) of the resultant
+//Grammar rule for finding the inverse of a matrix. Returns a matrix expression of the resultant
 //matrix to upper level.
 | INVERT LPAREN expr RPAREN
 {
+  ctx.reduced("expr: INVERT LPAREN expr RPAREN");
   //Algorithm referred from stackoverflow: https://stackoverflow.com/questions/983999/simple-3x3-matrix-inverse-code-c
-  $$ = new struct var_or_mat;
-  std::vector<std::vector<Value*> > mat = matrices[$3->mat_name];
-  if(mat.size() == 2)
+  $$ = ctx.make<var_or_mat>();
+  if($3->is_var)
+  {
+    yyerror("Inverse can't be taken for a scalar");
+    YYABORT;
+  }
+  matrix &a = ctx.evaluate($3->mat);
+  if(a.rows != a.cols)
+  {
+    yyerror("Inverse can't be taken for non square matrix");
+    YYABORT;
+  }
+  matrix mat = make_matrix(a.rows,a.cols);
+  if(mat.rows == 2)
   {
-    Value *det = find_determinant($3->mat_name);
-    mat[0][0] = Builder.CreateFDiv(matrices[$3->mat_name][1][1],det);
-    mat[0][1] = Builder.CreateFDiv(Builder.CreateFNeg(matrices[$3->mat_name][0][1]),det);
-    mat[1][0] = Builder.CreateFDiv(Builder.CreateFNeg(matrices[$3->mat_name][1][0]),det);
-    mat[1][1] = Builder.CreateFDiv(matrices[$3->mat_name][0][0],det);
+    Value *det = ctx.find_determinant(a);
+    mat[0][0] = ctx.fdiv(ctx.unrolled(a)[1][1],det);
+    mat[0][1] = ctx.fdiv(ctx.fneg(ctx.unrolled(a)[0][1]),det);
+    mat[1][0] = ctx.fdiv(ctx.fneg(ctx.unrolled(a)[1][0]),det);
+    mat[1][1] = ctx.fdiv(ctx.unrolled(a)[0][0],det);
 
-    matrices["temp"] =  mat;
     $$->is_var = false;
-    $$->mat_name = "temp";
+    $$->mat = ctx.result_expr(std::move(mat));
   }
-  else if(mat.size() == 3)
+  else if(mat.rows == 3)
   {
-    Value *det = find_determinant($3->mat_name);
-    Value* one = ConstantFP::get(Type::getFloatTy(TheContext), 1.0);
-    Value *inv_det = Builder.CreateFDiv(one,det);
-    mat[0][0] = Builder.CreateFMul(inv_det,Builder.CreateFSub(Builder.CreateFMul(matrices[$3->mat_name][1][1],matrices[$3->mat_name][2][2]),Builder.CreateFMul(matrices[$3->mat_name][2][1],matrices[$3->mat_name][1][2])));
-    mat[0][1] = Builder.CreateFMul(inv_det,Builder.CreateFSub(Builder.CreateFMul(matrices[$3->mat_name][0][2],matrices[$3->mat_name][2][1]),Builder.CreateFMul(matrices[$3->mat_name][0][1],matrices[$3->mat_name][2][2])));
-    mat[0][2] = Builder.CreateFMul(inv_det,Builder.CreateFSub(Builder.CreateFMul(matrices[$3->mat_name][0][1],matrices[$3->mat_name][1][2]),Builder.CreateFMul(matrices[$3->mat_name][0][2],matrices[$3->mat_name][1][1])));
+    Value *det = ctx.find_determinant(a);
+    Value* one = ConstantFP::get(Type::getFloatTy(ctx.TheContext), 1.0);
+    Value *inv_det = ctx.fdiv(one,det);
+    mat[0][0] = ctx.fmul(inv_det,ctx.fsub(ctx.fmul(ctx.unrolled(a)[1][1],ctx.unrolled(a)[2][2]),ctx.fmul(ctx.unrolled(a)[2][1],ctx.unrolled(a)[1][2])));
+    mat[0][1] = ctx.fmul(inv_det,ctx.fsub(ctx.fmul(ctx.unrolled(a)[0][2],ctx.unrolled(a)[2][1]),ctx.fmul(ctx.unrolled(a)[0][1],ctx.unrolled(a)[2][2])));
+    mat[0][2] = ctx.fmul(inv_det,ctx.fsub(ctx.fmul(ctx.unrolled(a)[0][1],ctx.unrolled(a)[1][2]),ctx.fmul(ctx.unrolled(a)[0][2],ctx.unrolled(a)[1][1])));
 
-    mat[1][0] = Builder.CreateFMul(inv_det,Builder.CreateFSub(Builder.CreateFMul(matrices[$3->mat_name][1][2],matrices[$3->mat_name][2][0]),Builder.CreateFMul(matrices[$3->mat_name][1][0],matrices[$3->mat_name][2][2])));
-    mat[1][1] = Builder.CreateFMul(inv_det,Builder.CreateFSub(Builder.CreateFMul(matrices[$3->mat_name][0][0],matrices[$3->mat_name][2][2]),Builder.CreateFMul(matrices[$3->mat_name][0][2],matrices[$3->mat_name][2][0])));
-    mat[1][2] = Builder.CreateFMul(inv_det,Builder.CreateFSub(Builder.CreateFMul(matrices[$3->mat_name][1][0],matrices[$3->mat_name][0][2]),Builder.CreateFMul(matrices[$3->mat_name][0][0],matrices[$3->mat_name][1][2])));
+    mat[1][0] = ctx.fmul(inv_det,ctx.fsub(ctx.fmul(ctx.unrolled(a)[1][2],ctx.unrolled(a)[2][0]),ctx.fmul(ctx.unrolled(a)[1][0],ctx.unrolled(a)[2][2])));
+    mat[1][1] = ctx.fmul(inv_det,ctx.fsub(ctx.fmul(ctx.unrolled(a)[0][0],ctx.unrolled(a)[2][2]),ctx.fmul(ctx.unrolled(a)[0][2],ctx.unrolled(a)[2][0])));
+    mat[1][2] = ctx.fmul(inv_det,ctx.fsub(ctx.fmul(ctx.unrolled(a)[1][0],ctx.unrolled(a)[0][2]),ctx.fmul(ctx.unrolled(a)[0][0],ctx.unrolled(a)[1][2])));
 
-    mat[2][0] = Builder.CreateFMul(inv_det,Builder.CreateFSub(Builder.CreateFMul(matrices[$3->mat_name][1][0],matrices[$3->mat_name][2][1]),Builder.CreateFMul(matrices[$3->mat_name][2][0],matrices[$3->mat_name][1][1])));
-    mat[2][1] = Builder.CreateFMul(inv_det,Builder.CreateFSub(Builder.CreateFMul(matrices[$3->mat_name][2][0],matrices[$3->mat_name][0][1]),Builder.CreateFMul(matrices[$3->mat_name][0][0],matrices[$3->mat_name][2][1])));
-    mat[2][2] = Builder.CreateFMul(inv_det,Builder.CreateFSub(Builder.CreateFMul(matrices[$3->mat_name][0][0],matrices[$3->mat_name][1][1]),Builder.CreateFMul(matrices[$3->mat_name][1][0],matrices[$3->mat_name][0][1])));
+    mat[2][0] = ctx.fmul(inv_det,ctx.fsub(ctx.fmul(ctx.unrolled(a)[1][0],ctx.unrolled(a)[2][1]),ctx.fmul(ctx.unrolled(a)[2][0],ctx.unrolled(a)[1][1])));
+    mat[2][1] = ctx.fmul(inv_det,ctx.fsub(ctx.fmul(ctx.unrolled(a)[2][0],ctx.unrolled(a)[0][1]),ctx.fmul(ctx.unrolled(a)[0][0],ctx.unrolled(a)[2][1])));
+    mat[2][2] = ctx.fmul(inv_det,ctx.fsub(ctx.fmul(ctx.unrolled(a)[0][0],ctx.unrolled(a)[1][1]),ctx.fmul(ctx.unrolled(a)[1][0],ctx.unrolled(a)[0][1])));
 
-    matrices["temp"] =  mat;
     $$->is_var = false;
-    $$->mat_name = "temp";
+    $$->mat = ctx.result_expr(std::move(mat));
   }
-  else if(mat.size() == 4)
+  else if(mat.rows == 4)
   {
     //Algorithm referenced from stackoverflow https://stackoverflow.com/questions/1148309/inverting-a-4x4-matrix?rq=1
-    std::vector<std::vector<Value*> > mat = matrices[$3->mat_name];
-    Value* m00 = matrices[$3->mat_name][0][0];
-    Value* m01 = matrices[$3->mat_name][0][1];
-    Value* m02 = matrices[$3->mat_name][0][2];
-    Value* m03 = matrices[$3->mat_name][0][3];
-
-    Value* m10 = matrices[$3->mat_name][1][0];
-    Value* m11 = matrices[$3->mat_name][1][1];
-    Value* m12 = matrices[$3->mat_name][1][2];
-    Value* m13 = matrices[$3->mat_name][1][3];
-
-    Value* m20 = matrices[$3->mat_name][2][0];
-    Value* m21 = matrices[$3->mat_name][2][1];
-    Value* m22 = matrices[$3->mat_name][2][2];
-    Value* m23 = matrices[$3->mat_name][2][3];
-
-    Value* m30 = matrices[$3->mat_name][3][0];
-    Value* m31 = matrices[$3->mat_name][3][1];
-    Value* m32 = matrices[$3->mat_name][3][2];
-    Value* m33 = matrices[$3->mat_name][3][3];
-
-    Value* A2323 = Builder.CreateFSub(Builder.CreateFMul(m22,m33),Builder.CreateFMul(m23,m32));
-    Value* A1323 = Builder.CreateFSub(Builder.CreateFMul(m21,m33),Builder.CreateFMul(m23,m31));
-    Value* A1223 = Builder.CreateFSub(Builder.CreateFMul(m21,m32),Builder.CreateFMul(m22,m31));
-    Value* A0323 = Builder.CreateFSub(Builder.CreateFMul(m20,m33),Builder.CreateFMul(m23,m30));
-    Value* A0223 = Builder.CreateFSub(Builder.CreateFMul(m20,m32),Builder.CreateFMul(m22,m30));
-    Value* A0123 = Builder.CreateFSub(Builder.CreateFMul(m20,m31),Builder.CreateFMul(m21,m30));
-    Value* A2313 = Builder.CreateFSub(Builder.CreateFMul(m12,m33),Builder.CreateFMul(m13,m32));
-    Value* A1313 = Builder.CreateFSub(Builder.CreateFMul(m11,m33),Builder.CreateFMul(m13,m31));
-    Value* A1213 = Builder.CreateFSub(Builder.CreateFMul(m11,m32),Builder.CreateFMul(m12,m31));
-    Value* A2312 = Builder.CreateFSub(Builder.CreateFMul(m12,m23),Builder.CreateFMul(m13,m22));
-    Value* A1312 = Builder.CreateFSub(Builder.CreateFMul(m11,m23),Builder.CreateFMul(m13,m21));
-    Value* A1212 = Builder.CreateFSub(Builder.CreateFMul(m11,m22),Builder.CreateFMul(m12,m21));
-    Value* A0313 = Builder.CreateFSub(Builder.CreateFMul(m10,m33),Builder.CreateFMul(m13,m30));
-    Value* A0213 = Builder.CreateFSub(Builder.CreateFMul(m10,m32),Builder.CreateFMul(m12,m30));
-    Value* A0312 = Builder.CreateFSub(Builder.CreateFMul(m10,m23),Builder.CreateFMul(m13,m20));
-    Value* A0212 = Builder.CreateFSub(Builder.CreateFMul(m10,m22),Builder.CreateFMul(m12,m20));
-    Value* A0113 = Builder.CreateFSub(Builder.CreateFMul(m10,m31),Builder.CreateFMul(m11,m30));
-    Value* A0112 = Builder.CreateFSub(Builder.CreateFMul(m10,m21),Builder.CreateFMul(m11,m20));
-
-    Value *det = find_determinant($3->mat_name);
-    Value* one = ConstantFP::get(Type::getFloatTy(TheContext), 1.0);
-    Value *inv_det = Builder.CreateFDiv(one,det);
-
-    mat[0][0] = Builder.CreateFMul(inv_det ,Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m11 , A2323) , Builder.CreateFMul(m12 , A1323)) , Builder.CreateFMul(m13 , A1223)));
-    mat[0][1] = Builder.CreateFMul(inv_det ,Builder.CreateFNeg(Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m01 , A2323) , Builder.CreateFMul(m02 , A1323)) , Builder.CreateFMul(m03 , A1223))));
-    mat[0][2] = Builder.CreateFMul(inv_det ,Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m01 , A2313) , Builder.CreateFMul(m02 , A1313)) , Builder.CreateFMul(m03 , A1213)));
-    mat[0][3] = Builder.CreateFMul(inv_det ,Builder.CreateFNeg(Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m01 , A2312) , Builder.CreateFMul(m02 , A1312)) , Builder.CreateFMul(m03 , A1212))));
-    mat[1][0] = Builder.CreateFMul(inv_det ,Builder.CreateFNeg(Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m10 , A2323) , Builder.CreateFMul(m12 , A0323)) , Builder.CreateFMul(m13 , A0223))));
-    mat[1][1] = Builder.CreateFMul(inv_det ,Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m00 , A2323) , Builder.CreateFMul(m02 , A0323)) , Builder.CreateFMul(m03 , A0223)));
-    mat[1][2] = Builder.CreateFMul(inv_det ,Builder.CreateFNeg(Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m00 , A2313) , Builder.CreateFMul(m02 , A0313)) , Builder.CreateFMul(m03 , A0213))));
-    mat[1][3] = Builder.CreateFMul(inv_det ,Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m00 , A2312) , Builder.CreateFMul(m02 , A0312)) , Builder.CreateFMul(m03 , A0212)));
-    mat[2][0] = Builder.CreateFMul(inv_det ,Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m10 , A1323) , Builder.CreateFMul(m11 , A0323)) , Builder.CreateFMul(m13 , A0123)));
-    mat[2][1] = Builder.CreateFMul(inv_det ,Builder.CreateFNeg(Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m00 , A1323) , Builder.CreateFMul(m01 , A0323)) , Builder.CreateFMul(m03 , A0123))));
-    mat[2][2] = Builder.CreateFMul(inv_det ,Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m00 , A1313) , Builder.CreateFMul(m01 , A0313)) , Builder.CreateFMul(m03 , A0113)));
-    mat[2][3] = Builder.CreateFMul(inv_det ,Builder.CreateFNeg(Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m00 , A1312) , Builder.CreateFMul(m01 , A0312)) , Builder.CreateFMul(m03 , A0112))));
-    mat[3][0] = Builder.CreateFMul(inv_det ,Builder.CreateFNeg(Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m10 , A1223) , Builder.CreateFMul(m11 , A0223)) , Builder.CreateFMul(m12 , A0123))));
-    mat[3][1] = Builder.CreateFMul(inv_det ,Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m00 , A1223) , Builder.CreateFMul(m01 , A0223)) , Builder.CreateFMul(m02 , A0123)));
-    mat[3][2] = Builder.CreateFMul(inv_det ,Builder.CreateFNeg(Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m00 , A1213) , Builder.CreateFMul(m01 , A0213)) , Builder.CreateFMul(m02 , A0113))));
-    mat[3][3] = Builder.CreateFMul(inv_det ,Builder.CreateFAdd(Builder.CreateFSub(Builder.CreateFMul(m00 , A1212) , Builder.CreateFMul(m01 , A0212)) , Builder.CreateFMul(m02 , A0112)));
-
-    matrices["temp"] =  mat;
+    Value* m00 = ctx.unrolled(a)[0][0];
+    Value* m01 = ctx.unrolled(a)[0][1];
+    Value* m02 = ctx.unrolled(a)[0][2];
+    Value* m03 = ctx.unrolled(a)[0][3];
+
+    Value* m10 = ctx.unrolled(a)[1][0];
+    Value* m11 = ctx.unrolled(a)[1][1];
+    Value* m12 = ctx.unrolled(a)[1][2];
+    Value* m13 = ctx.unrolled(a)[1][3];
+
+    Value* m20 = ctx.unrolled(a)[2][0];
+    Value* m21 = ctx.unrolled(a)[2][1];
+    Value* m22 = ctx.unrolled(a)[2][2];
+    Value* m23 = ctx.unrolled(a)[2][3];
+
+    Value* m30 = ctx.unrolled(a)[3][0];
+    Value* m31 = ctx.unrolled(a)[3][1];
+    Value* m32 = ctx.unrolled(a)[3][2];
+    Value* m33 = ctx.unrolled(a)[3][3];
+
+    Value* A2323 = ctx.fsub(ctx.fmul(m22,m33),ctx.fmul(m23,m32));
+    Value* A1323 = ctx.fsub(ctx.fmul(m21,m33),ctx.fmul(m23,m31));
+    Value* A1223 = ctx.fsub(ctx.fmul(m21,m32),ctx.fmul(m22,m31));
+    Value* A0323 = ctx.fsub(ctx.fmul(m20,m33),ctx.fmul(m23,m30));
+    Value* A0223 = ctx.fsub(ctx.fmul(m20,m32),ctx.fmul(m22,m30));
+    Value* A0123 = ctx.fsub(ctx.fmul(m20,m31),ctx.fmul(m21,m30));
+    Value* A2313 = ctx.fsub(ctx.fmul(m12,m33),ctx.fmul(m13,m32));
+    Value* A1313 = ctx.fsub(ctx.fmul(m11,m33),ctx.fmul(m13,m31));
+    Value* A1213 = ctx.fsub(ctx.fmul(m11,m32),ctx.fmul(m12,m31));
+    Value* A2312 = ctx.fsub(ctx.fmul(m12,m23),ctx.fmul(m13,m22));
+    Value* A1312 = ctx.fsub(ctx.fmul(m11,m23),ctx.fmul(m13,m21));
+    Value* A1212 = ctx.fsub(ctx.fmul(m11,m22),ctx.fmul(m12,m21));
+    Value* A0313 = ctx.fsub(ctx.fmul(m10,m33),ctx.fmul(m13,m30));
+    Value* A0213 = ctx.fsub(ctx.fmul(m10,m32),ctx.fmul(m12,m30));
+    Value* A0312 = ctx.fsub(ctx.fmul(m10,m23),ctx.fmul(m13,m20));
+    Value* A0212 = ctx.fsub(ctx.fmul(m10,m22),ctx.fmul(m12,m20));
+    Value* A0113 = ctx.fsub(ctx.fmul(m10,m31),ctx.fmul(m11,m30));
+    Value* A0112 = ctx.fsub(ctx.fmul(m10,m21),ctx.fmul(m11,m20));
+
+    Value *det = ctx.find_determinant(a);
+    Value* one = ConstantFP::get(Type::getFloatTy(ctx.TheContext), 1.0);
+    Value *inv_det = ctx.fdiv(one,det);
+
+    mat[0][0] = ctx.fmul(inv_det ,ctx.fadd(ctx.fsub(ctx.fmul(m11 , A2323) , ctx.fmul(m12 , A1323)) , ctx.fmul(m13 , A1223)));
+    mat[0][1] = ctx.fmul(inv_det ,ctx.fneg(ctx.fadd(ctx.fsub(ctx.fmul(m01 , A2323) , ctx.fmul(m02 , A1323)) , ctx.fmul(m03 , A1223))));
+    mat[0][2] = ctx.fmul(inv_det ,ctx.fadd(ctx.fsub(ctx.fmul(m01 , A2313) , ctx.fmul(m02 , A1313)) , ctx.fmul(m03 , A1213)));
+    mat[0][3] = ctx.fmul(inv_det ,ctx.fneg(ctx.fadd(ctx.fsub(ctx.fmul(m01 , A2312) , ctx.fmul(m02 , A1312)) , ctx.fmul(m03 , A1212))));
+    mat[1][0] = ctx.fmul(inv_det ,ctx.fneg(ctx.fadd(ctx.fsub(ctx.fmul(m10 , A2323) , ctx.fmul(m12 , A0323)) , ctx.fmul(m13 , A0223))));
+    mat[1][1] = ctx.fmul(inv_det ,ctx.fadd(ctx.fsub(ctx.fmul(m00 , A2323) , ctx.fmul(m02 , A0323)) , ctx.fmul(m03 , A0223)));
+    mat[1][2] = ctx.fmul(inv_det ,ctx.fneg(ctx.fadd(ctx.fsub(ctx.fmul(m00 , A2313) , ctx.fmul(m02 , A0313)) , ctx.fmul(m03 , A0213))));
+    mat[1][3] = ctx.fmul(inv_det ,ctx.fadd(ctx.fsub(ctx.fmul(m00 , A2312) , ctx.fmul(m02 , A0312)) , ctx.fmul(m03 , A0212)));
+    mat[2][0] = ctx.fmul(inv_det ,ctx.fadd(ctx.fsub(ctx.fmul(m10 , A1323) , ctx.fmul(m11 , A0323)) , ctx.fmul(m13 , A0123)));
+    mat[2][1] = ctx.fmul(inv_det ,ctx.fneg(ctx.fadd(ctx.fsub(ctx.fmul(m00 , A1323) , ctx.fmul(m01 , A0323)) , ctx.fmul(m03 , A0123))));
+    mat[2][2] = ctx.fmul(inv_det ,ctx.fadd(ctx.fsub(ctx.fmul(m00 , A1313) , ctx.fmul(m01 , A0313)) , ctx.fmul(m03 , A0113)));
+    mat[2][3] = ctx.fmul(inv_det ,ctx.fneg(ctx.fadd(ctx.fsub(ctx.fmul(m00 , A1312) , ctx.fmul(m01 , A0312)) , ctx.fmul(m03 , A0112))));
+    mat[3][0] = ctx.fmul(inv_det ,ctx.fneg(ctx.fadd(ctx.fsub(ctx.fmul(m10 , A1223) , ctx.fmul(m11 , A0223)) , ctx.fmul(m12 , A0123))));
+    mat[3][1] = ctx.fmul(inv_det ,ctx.fadd(ctx.fsub(ctx.fmul(m00 , A1223) , ctx.fmul(m01 , A0223)) , ctx.fmul(m02 , A0123)));
+    mat[3][2] = ctx.fmul(inv_det ,ctx.fneg(ctx.fadd(ctx.fsub(ctx.fmul(m00 , A1213) , ctx.fmul(m01 , A0213)) , ctx.fmul(m02 , A0113))));
+    mat[3][3] = ctx.fmul(inv_det ,ctx.fadd(ctx.fsub(ctx.fmul(m00 , A1212) , ctx.fmul(m01 , A0212)) , ctx.fmul(m02 , A0112)));
+
     $$->is_var = false;
-    $$->mat_name = "temp";
+    $$->mat = ctx.result_expr(std::move(mat));
 
   }
   else
   {
-    yyerror("Size of matrix is more than 4, requires size to be less than or equal to 4\n");
-    YYABORT;
+    //Bigger matrices are inverted with the LU decomposition.
+    $$->is_var = false;
+    $$->mat = ctx.result_expr(ctx.inverse_loop(a));
   }
 }
-//Grammar rule for performing the transpose operation of a matrix. Returns a std::string type (matrix name) of the resultant
+//Grammar rule for performing the transpose operation of a matrix. Returns a matrix expression of the resultant
 //matrix to upper level.
 | TRANSPOSE LPAREN expr RPAREN
 {
-  $$ = new struct var_or_mat;
-  std::vector<std::vector<Value*> > a = matrices[$3->mat_name];
-  for(int i=0;i<a[0].size();i++)
+  ctx.reduced("expr: TRANSPOSE LPAREN expr RPAREN");
+  $$ = ctx.make<var_or_mat>();
+  if($3->is_var)
+  {
+    yyerror("Transpose can't be taken for a scalar");
+    YYABORT;
+  }
+  matrix &m = ctx.evaluate($3->mat);
+  if(m.storage != NULL)
+  {
+    $$->mat = ctx.result_expr(ctx.transpose_loop(m));
+  }
+  else
   {
-    for(int j=0;j<a.size();j++)
+    matrix &a = ctx.unrolled(m);
+    matrix t = make_matrix(a.cols,a.rows);
+    for(int i=0;i<a.cols;i++)
     {
-      a[i][j] = matrices[$3->mat_name][j][i];
+      for(int j=0;j<a.rows;j++)
+      {
+        t[i][j] = a[j][i];
+      }
     }
+    $$->mat = ctx.result_expr(std::move(t));
   }
-
-  matrices["temp"] = a;
   $$->is_var = false;
-  $$->mat_name = "temp";
 }
 //Grammar rule for getting a single value from a matrix. Return a Value* type (float value) to upper level.
 | ID LBRACKET INT COMMA INT RBRACKET
 {
-  $$ = new struct var_or_mat;
+  ctx.reduced("expr: ID LBRACKET INT COMMA INT RBRACKET");
+  $$ = ctx.make<var_or_mat>();
   int row = $3;
   int col = $5;
-  $$->value = matrices[$1][row][col];
+  if(ctx.matrices[$1] < 0)
+  {
+    yyerror("Element access of a variable which is not a matrix");
+    YYABORT;
+  }
+  matrix &m = ctx.matrix_table[ctx.matrices[$1]];
+  if(m.elements.empty())
+    $$->value = ctx.load_element(m,ctx.Builder.getInt32(row),ctx.Builder.getInt32(col));
+  else
+    $$->value = m[row][col];
   $$->is_var = true;
 }
 //Grammar rule for performing reduction operation of a matrix. Returns a std::string type (matrix name) of the resultant
 //matrix to upper level.
 | REDUCE LPAREN expr RPAREN
 {
-  $$ = new struct var_or_mat;
-  $$->value = reduction($3->mat_name);
+  ctx.reduced("expr: REDUCE LPAREN expr RPAREN");
+  $$ = ctx.make<var_or_mat>();
+  if($3->is_var)
+  {
+    yyerror("Reduction can't be taken for a scalar");
+    YYABORT;
+  }
+  $$->value = ctx.reduction($3->mat);
   $$->is_var = true;
 }
 //Grammar rule for providing precedence of an expression using a variable or matrix. Returns a Value* or 
 //std::string (float type) to upper level.
 | LPAREN expr RPAREN 
 {
-  $$ = new struct var_or_mat;
+  ctx.reduced("expr: LPAREN expr RPAREN");
   $$ = $2;
 }
 ;
@@ -931,7 +2785,22 @@ expr: ID
 
 %%
 
-unique_ptr<Module> parseP1File(const string &InputFilename)
+//Scanner of the parser. Counts and times the tokens when the compilation is profiled.
+int yylex(YYSTYPE *lvalp,yyscan_t scanner,p1_context &ctx)
+{
+  if (ctx.profile == NULL)
+    return yylex(lvalp,scanner);
+  ctx.start_phase(p1_context::PHASE_SCAN);
+  int token = yylex(lvalp,scanner);
+  // The parser runs its tables until the next action
+  ctx.start_phase(p1_context::PHASE_PARSE);
+  if (token != 0)
+    ctx.profile->tokens++;
+  return token;
+}
+
+unique_ptr<Module> parseP1File(const string &InputFilename,LLVMContext &Context,const p1_options &options,
+                               p1_profile *profile)
 {
   string modName = InputFilename;
   if (modName.find_last_of('/') != string::npos)
@@ -939,35 +2808,96 @@ unique_ptr<Module> parseP1File(const string &InputFilename)
   if (modName.find_last_of('.') != string::npos)
     modName.resize(modName.find_last_of('.'));
 
+  // State of this compilation
+  p1_context ctx(Context,options);
+  if (profile != NULL) {
+    *profile = p1_profile();
+    ctx.profile = profile;
+    ctx.checkpoint = std::chrono::steady_clock::now();
+  }
+
   // unique_ptr will clean up after us, call destructor, etc.
-  unique_ptr<Module> Mptr(new Module(modName.c_str(), TheContext));
+  unique_ptr<Module> Mptr(new Module(modName.c_str(), Context));
 
-  // set global module
-  M = Mptr.get();
+  // set module of the compilation
+  ctx.M = Mptr.get();
   
   /* this is the name of the file to generate, you can also use
      this string to figure out the name of the generated function */
 
-  if (InputFilename == "--")
-    yyin = stdin;
-  else	  
-    yyin = fopen(InputFilename.c_str(),"r");
+  yyscan_t scanner;
+  yylex_init_extra(&ctx,&scanner);
+  scan_input *input = scan_file(scanner,InputFilename.c_str(),options.trace);
+  if (input == NULL) {
+    errs() << "Can't read " << InputFilename << "\n";
+    yylex_destroy(scanner);
+    Mptr.reset();
+    return Mptr;
+  }
 
-  yydebug = 1;
-  if (yyparse() != 0) {
-    // Dump LLVM IR to the screen for debugging
-    M->print(errs(),nullptr,false,true);
+  // yydebug is shared by all the parsers, it is only touched when tracing
+  if (options.trace)
+    yydebug = 1;
+  bool parsed = yyparse(scanner,ctx) == 0;
+  if (parsed && options.batch_kernel) {
+    if (profile != NULL)
+      ctx.enter_rule("batch kernel");
+    ctx.add_batch_kernel(ctx.M->getFunction(ctx.funName));
+  }
+  if (profile != NULL)
+    ctx.start_phase(p1_context::PHASE_PARSE);
+  // Dump LLVM IR to the screen for debugging
+  auto print_start = std::chrono::steady_clock::now();
+  if (options.trace)
+    ctx.M->print(errs(),nullptr,false,true);
+  if (profile != NULL)
+    profile->print_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - print_start).count();
+  if (!parsed) {
     // errors, so discard module
     Mptr.reset();
   } else {
-    // Dump LLVM IR to the screen for debugging
-    M->print(errs(),nullptr,false,true);
+    if (options.fold_stats)
+      errs() << modName << ": folded " << ctx.folded_ops << " and reused " << ctx.reused_ops
+             << " floating point instructions, structural zeros and identities saved " << ctx.structural_flops
+             << " FLOPs\n";
+  }
+  end_scan(scanner,input);
+  yylex_destroy(scanner);
+
+  if (profile != NULL) {
+    profile->symbols = ctx.symbol_names.size();
+    profile->matrices = ctx.matrix_table.size();
+    for (auto &rule: ctx.rule_profiles)
+      profile->rules[rule.first] = rule.second;
   }
-  
   return Mptr;
 }
 
+long scanP1File(const string &InputFilename,const p1_options &options)
+{
+  LLVMContext Context;
+  p1_context ctx(Context,options);
+  yyscan_t scanner;
+  yylex_init_extra(&ctx,&scanner);
+  scan_input *input = scan_file(scanner,InputFilename.c_str(),options.trace);
+  long tokens = -1;
+  if (input != NULL) {
+    YYSTYPE value;
+    tokens = 0;
+    while (yylex(&value,scanner) != 0)
+      tokens++;
+    end_scan(scanner,input);
+  }
+  yylex_destroy(scanner);
+  return tokens;
+}
+
 void yyerror(const char* msg)
 {
   printf("%s\n",msg);
 }
+
+void yyerror(yyscan_t,p1_context&,const char* msg)
+{
+  yyerror(msg);
+}
@@ -0,0 +1,303 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include "p1rt.h"
+
+//The kernels are written with the vector extensions of GCC and Clang, which are lowered to the widest vector unit the
+//runtime is compiled for: build it with -O2 -march=native (or the -mcpu of the generated code) to get AVX2 or AVX-512.
+//Without such flags the 8 lanes are split over SSE registers.
+typedef float vfloat __attribute__((vector_size(32)));
+const int lanes = sizeof(vfloat)/sizeof(float);
+
+//Rows of the inner dimension and columns of b a block of the product works on, so the rows of b it reads (kc x nc
+//floats) stay in the L2 cache while the rows of a go by.
+const int gemm_kc = 256;
+const int gemm_nc = 256;
+//Columns of the panels of the blocked LU decomposition.
+const int lu_block = 32;
+//Rows and columns of the transpose blocks.
+const int transpose_block = 16;
+
+//Vectors of floats at any offset, read and written through pointers: a vfloat passed or returned by value would change
+//the calling convention with the vector unit (-Wpsabi) when the runtime is built without -march flags.
+typedef float vfloat_unaligned __attribute__((vector_size(32),aligned(sizeof(float)),may_alias));
+
+static inline const vfloat_unaligned* vec(const float* p)
+{
+  return reinterpret_cast<const vfloat_unaligned*>(p);
+}
+
+static inline vfloat_unaligned* vec(float* p)
+{
+  return reinterpret_cast<vfloat_unaligned*>(p);
+}
+
+//y -= alpha * x over count floats.
+static void sub_scaled(float* y,const float* x,float alpha,int count)
+{
+  int i = 0;
+  for(;i+lanes<=count;i+=lanes)
+  {
+    *vec(y+i) -= alpha*(*vec(x+i));
+  }
+  for(;i<count;i++)
+  {
+    y[i] -= alpha*x[i];
+  }
+}
+
+//Adds the product of R rows of a and kc rows of b to R rows of c, over V vectors of columns. The R x V partial sums are
+//kept in registers for the whole inner dimension.
+template<int R,int V>
+static void gemm_kernel(const float* a,int lda,const float* b,int ldb,float* c,int ldc,int kc)
+{
+  vfloat sum[R][V];
+  for(int r=0;r<R;r++)
+  {
+    for(int v=0;v<V;v++)
+    {
+      sum[r][v] = *vec(c+r*ldc+v*lanes);
+    }
+  }
+  for(int p=0;p<kc;p++)
+  {
+    vfloat row[V];
+    for(int v=0;v<V;v++)
+    {
+      row[v] = *vec(b+p*ldb+v*lanes);
+    }
+    for(int r=0;r<R;r++)
+    {
+      float x = a[r*lda+p];
+      for(int v=0;v<V;v++)
+      {
+        sum[r][v] += x*row[v];
+      }
+    }
+  }
+  for(int r=0;r<R;r++)
+  {
+    for(int v=0;v<V;v++)
+    {
+      *vec(c+r*ldc+v*lanes) = sum[r][v];
+    }
+  }
+}
+
+//Adds the product of R rows of a and kc rows of b to the columns j0 to j1-1 of R rows of c, two vectors of columns at
+//a time, then one, then the columns left over one at a time.
+template<int R>
+static void gemm_rows(const float* a,int lda,const float* b,int ldb,float* c,int ldc,int kc,int j0,int j1)
+{
+  int j = j0;
+  for(;j+2*lanes<=j1;j+=2*lanes)
+  {
+    gemm_kernel<R,2>(a,lda,b+j,ldb,c+j,ldc,kc);
+  }
+  for(;j+lanes<=j1;j+=lanes)
+  {
+    gemm_kernel<R,1>(a,lda,b+j,ldb,c+j,ldc,kc);
+  }
+  for(;j<j1;j++)
+  {
+    for(int r=0;r<R;r++)
+    {
+      float sum = c[r*ldc+j];
+      for(int p=0;p<kc;p++)
+      {
+        sum += a[r*lda+p]*b[p*ldb+j];
+      }
+      c[r*ldc+j] = sum;
+    }
+  }
+}
+
+//Adds the product of the m x kc matrix a and the kc x n matrix b to c, four rows at a time over blocks of gemm_nc
+//columns. kc is at most gemm_kc.
+static void gemm_block(const float* a,int lda,const float* b,int ldb,float* c,int ldc,int m,int kc,int n)
+{
+  for(int j0=0;j0<n;j0+=gemm_nc)
+  {
+    int j1 = std::min(j0+gemm_nc,n);
+    int i = 0;
+    for(;i+4<=m;i+=4)
+    {
+      gemm_rows<4>(a+i*lda,lda,b,ldb,c+i*ldc,ldc,kc,j0,j1);
+    }
+    for(;i<m;i++)
+    {
+      gemm_rows<1>(a+i*lda,lda,b,ldb,c+i*ldc,ldc,kc,j0,j1);
+    }
+  }
+}
+
+void p1rt_gemm(const float* a,const float* b,float* c,int m,int k,int n)
+{
+  memset(c,0,sizeof(float)*m*n);
+  for(int k0=0;k0<k;k0+=gemm_kc)
+  {
+    gemm_block(a+k0,k,b+k0*n,n,c,n,m,std::min(gemm_kc,k-k0),n);
+  }
+}
+
+//LU decomposition with partial pivoting of the n x n matrix in lu, in place, like lu_decompose of the parser: L below
+//the diagonal, U on and above it. perm gets the original row of every row. Returns the sign of the permutation.
+//The columns are factored in panels of lu_block: the elimination only updates the panel, then the rows of U right of
+//it are solved and the rest of the matrix is updated at once by the GEMM kernel, where most of the work is.
+static float lu_factor(float* lu,int* perm,int n)
+{
+  float sign = 1;
+  for(int i=0;i<n;i++)
+  {
+    perm[i] = i;
+  }
+  std::vector<float> panel;
+  for(int k0=0;k0<n;k0+=lu_block)
+  {
+    int k1 = std::min(k0+lu_block,n);
+    for(int k=k0;k<k1;k++)
+    {
+      int pivot = k;
+      for(int i=k+1;i<n;i++)
+      {
+        if(std::fabs(lu[i*n+k]) > std::fabs(lu[pivot*n+k]))
+          pivot = i;
+      }
+      //Whole rows are swapped, so the columns of L on the left and the ones still to be factored follow.
+      if(pivot != k)
+      {
+        std::swap_ranges(lu+k*n,lu+(k+1)*n,lu+pivot*n);
+        std::swap(perm[k],perm[pivot]);
+        sign = -sign;
+      }
+      //A zero pivot means the column is zero below the diagonal and the matrix is singular: the column is skipped
+      //instead of dividing by zero, like the inline LU, and the determinant comes out 0.
+      float diagonal = lu[k*n+k];
+      for(int i=(diagonal == 0 ? n : k+1);i<n;i++)
+      {
+        float factor = lu[i*n+k]/diagonal;
+        lu[i*n+k] = factor;
+        sub_scaled(lu+i*n+k+1,lu+k*n+k+1,factor,k1-k-1);
+      }
+    }
+    if(k1 == n)
+      break;
+    //Rows k0 to k1-1 of U right of the panel, by forward substitution with the unit lower triangle of the panel.
+    for(int k=k0;k<k1;k++)
+    {
+      for(int i=k+1;i<k1;i++)
+      {
+        sub_scaled(lu+i*n+k1,lu+k*n+k1,lu[i*n+k],n-k1);
+      }
+    }
+    //The rest of the matrix minus the product of the panel of L below and the rows of U just solved. The panel is
+    //copied negated, so the update is a plain GEMM accumulation.
+    int rows = n-k1;
+    int kc = k1-k0;
+    panel.resize(rows*kc);
+    for(int i=0;i<rows;i++)
+    {
+      for(int k=0;k<kc;k++)
+      {
+        panel[i*kc+k] = -lu[(k1+i)*n+k0+k];
+      }
+    }
+    gemm_block(panel.data(),kc,lu+k0*n+k1,n,lu+k1*n+k1,n,rows,kc,n-k1);
+  }
+  return sign;
+}
+
+float p1rt_det(const float* a,int n)
+{
+  std::vector<float> lu(a,a+n*n);
+  std::vector<int> perm(n);
+  float det = lu_factor(lu.data(),perm.data(),n);
+  for(int i=0;i<n;i++)
+  {
+    det *= lu[i*n+i];
+  }
+  return det;
+}
+
+//The substitutions work on whole rows of the result, so every step is a vector update of a row.
+void p1rt_invert(const float* a,float* result,int n)
+{
+  std::vector<float> lu(a,a+n*n);
+  std::vector<int> perm(n);
+  lu_factor(lu.data(),perm.data(),n);
+  //Forward substitution with L, the rows of the identity in pivot order.
+  memset(result,0,sizeof(float)*n*n);
+  for(int i=0;i<n;i++)
+  {
+    float* row = result+i*n;
+    row[perm[i]] = 1;
+    for(int j=0;j<i;j++)
+    {
+      sub_scaled(row,result+j*n,lu[i*n+j],n);
+    }
+  }
+  //Back substitution with U, from the last row up.
+  for(int i=n-1;i>=0;i--)
+  {
+    float* row = result+i*n;
+    for(int j=i+1;j<n;j++)
+    {
+      sub_scaled(row,result+j*n,lu[i*n+j],n);
+    }
+    float diagonal = lu[i*n+i];
+    for(int j=0;j<n;j++)
+    {
+      row[j] /= diagonal;
+    }
+  }
+}
+
+//Copies blocks of transpose_block x transpose_block, so both the rows read and the rows written stay in the cache.
+void p1rt_transpose(const float* a,float* result,int rows,int cols)
+{
+  for(int i0=0;i0<rows;i0+=transpose_block)
+  {
+    int i1 = std::min(i0+transpose_block,rows);
+    for(int j0=0;j0<cols;j0+=transpose_block)
+    {
+      int j1 = std::min(j0+transpose_block,cols);
+      for(int i=i0;i<i1;i++)
+      {
+        for(int j=j0;j<j1;j++)
+        {
+          result[j*rows+i] = a[i*cols+j];
+        }
+      }
+    }
+  }
+}
+
+float p1rt_reduce(const float* a,int count)
+{
+  vfloat sum[4] = {};
+  int i = 0;
+  for(;i+4*lanes<=count;i+=4*lanes)
+  {
+    for(int s=0;s<4;s++)
+    {
+      sum[s] += *vec(a+i+s*lanes);
+    }
+  }
+  for(;i+lanes<=count;i+=lanes)
+  {
+    sum[0] += *vec(a+i);
+  }
+  vfloat total = (sum[0]+sum[1])+(sum[2]+sum[3]);
+  float result = 0;
+  for(int l=0;l<lanes;l++)
+  {
+    result += total[l];
+  }
+  for(;i<count;i++)
+  {
+    result += a[i];
+  }
+  return result;
+}
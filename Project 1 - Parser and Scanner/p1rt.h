@@ -0,0 +1,33 @@
+#ifndef P1RT_H
+#define P1RT_H
+
+//libp1rt: kernels of the large matrix operations, called by the code p1 generates for matrices with at least
+//runtime_cutoff rows or columns (see p1_options). All the matrices are row-major float arrays. The kernels have C
+//linkage so the generated code can call them by name, link the objects p1 writes with p1rt.o.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//c = a * b, where a is m x k, b is k x n and c is m x n. c doesn't overlap a or b.
+void p1rt_gemm(const float* a,const float* b,float* c,int m,int k,int n);
+
+//Determinant of the n x n matrix a from its LU decomposition with partial pivoting. a is left unchanged.
+float p1rt_det(const float* a,int n);
+
+//result = inverse of the n x n matrix a, solving A X = I with the LU factors of a. A singular matrix gives infinities
+//and NaNs, like the inline code.
+void p1rt_invert(const float* a,float* result,int n);
+
+//result = transpose of the rows x cols matrix a.
+void p1rt_transpose(const float* a,float* result,int rows,int cols);
+
+//Sum of the count floats of a. The sum is split over several vector accumulators, so it rounds like the reduction of
+//-fast-math rather than the one of the inline loop.
+float p1rt_reduce(const float* a,int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
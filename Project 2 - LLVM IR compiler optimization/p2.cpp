@@ -24,6 +24,9 @@
 #include "llvm/Support/ManagedStatic.h"
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/Analysis/InstructionSimplify.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/ScopedHashTable.h"
 
 #include "llvm/Support/CBindingWrapping.h"
 
@@ -318,138 +321,141 @@ bool cse_cant_eliminate(Instruction *I)
     return false;
 }
 
-//Comparing the instructions for opcode, type, operands and the expression. 
-//Returns True if they are common subexpressions (commutation is not considered only direct matching is considered).
-//Returns False if this is not the case.
-bool common_subexpressions(LLVMValueRef child_instruction_iter, LLVMValueRef parent_instruction_iter)
+//Instructions which CSE may replace by an earlier identical instruction: besides the ones listed above, anything that
+//touches memory, has side effects, ends a block or produces no value is left alone.
+bool cse_candidate(Instruction *I)
 {
-    Instruction *child_instruction = dyn_cast<Instruction>(unwrap(child_instruction_iter));
-    Instruction *parent_instruction = dyn_cast<Instruction>(unwrap(parent_instruction_iter));
-    bool flag = false;
-    //Checking the opcode of 2 instructions.
-    if(child_instruction->getOpcode() == parent_instruction->getOpcode()) 
-    {
-        //Checking the types of 2 instructions.
-        if(child_instruction->getType() == parent_instruction->getType())
-        {
-            //Checking the number of operands of both instructions
-            if(child_instruction->getNumOperands() == parent_instruction->getNumOperands())
-            {
-                //Checking if the operands match exactly for both instructions.
-                for(int i=0;i<child_instruction->getNumOperands();i++)
-                {
-                    LLVMValueRef parent_operand = wrap(parent_instruction->getOperand(i));
-                    LLVMValueRef child_operand = wrap(child_instruction->getOperand(i));
+    return !cse_cant_eliminate(I) && !I->isTerminator() && !I->isEHPad() && !I->mayReadOrWriteMemory() &&
+           !I->mayHaveSideEffects() && !I->getType()->isVoidTy();
+}
 
-                    if(parent_operand != child_operand)
-                    {
-                        return false;
-                    }
-                    else
-                    {
-                        flag=true;
-                    }
-                }
-            }
-        }
-            
+//Operands of an instruction in canonical order. The two operands of a commutative instruction are sorted, so a+b and
+//b+a give the same expression.
+void canonical_operands(Instruction *I, SmallVectorImpl<Value *> &operands)
+{
+    for(Value *operand: I->operands())
+    {
+        operands.push_back(operand);
+    }
+    if(I->isCommutative() && operands[1] < operands[0])
+    {
+        std::swap(operands[0],operands[1]);
     }
-   if(flag == true)
-   {
-    return true;
-   }
-   return false;
-    
 }
 
-//Recursive Common Subexpression elimination
-void check_instructions_with_rest(LLVMValueRef inst_iter,bool same_block,LLVMBasicBlockRef bb_iter)
+//Key of the CSE hash table: the expression an instruction computes, i.e. its opcode, type and canonical operands.
+struct cse_expression
 {
-    //If the Instruction is of type listed above which cannot be elimnated, it returns.
-    if(cse_cant_eliminate(dyn_cast<Instruction>(unwrap(inst_iter))))
+    Instruction *instruction;
+};
+
+namespace llvm {
+template <> struct DenseMapInfo<cse_expression>
+{
+    static cse_expression getEmptyKey()
     {
-        return;
+        return {DenseMapInfo<Instruction *>::getEmptyKey()};
     }
-    else
+    static cse_expression getTombstoneKey()
     {
-        //Checking the CSE of an instruction with all the instructions in the same basic block
-        if(same_block)
+        return {DenseMapInfo<Instruction *>::getTombstoneKey()};
+    }
+    static unsigned getHashValue(cse_expression expression)
+    {
+        Instruction *I = expression.instruction;
+        SmallVector<Value *, 4> operands;
+        canonical_operands(I,operands);
+        return hash_combine(I->getOpcode(),I->getType(),hash_combine_range(operands.begin(),operands.end()));
+    }
+    //Same opcode, type and special state (predicates, shuffle masks, indices), and the same canonical operands.
+    static bool isEqual(cse_expression left, cse_expression right)
+    {
+        Instruction *L = left.instruction;
+        Instruction *R = right.instruction;
+        if(L == R || L == getEmptyKey().instruction || L == getTombstoneKey().instruction ||
+           R == getEmptyKey().instruction || R == getTombstoneKey().instruction)
         {
-            LLVMValueRef local_inst_iter=LLVMGetNextInstruction(inst_iter);
-            while(local_inst_iter != NULL)
-            {
-                //If they are same, then we can perform the optimization.
-                if(common_subexpressions(local_inst_iter,inst_iter))
-                {
-                    //Replacing all the uses of the instruction with the value from the common instruction.
-                    unwrap(local_inst_iter)->replaceAllUsesWith(unwrap(inst_iter));
-                    //Increment the counter.
-                    CSEElim++;
-                    //Removing the redundant instructions.
-                    auto remove_instruction = dyn_cast<Instruction>(unwrap(local_inst_iter));
-                    local_inst_iter = LLVMGetNextInstruction(local_inst_iter);
-                    remove_instruction->eraseFromParent();
-                    continue;
-                }
-                local_inst_iter=LLVMGetNextInstruction(local_inst_iter);
-            }
-            //Checking the basic blocks which are dominated by the parent basic block.
-            LLVMBasicBlockRef child_basicblock;
-            for(child_basicblock = LLVMFirstDomChild(bb_iter); child_basicblock != NULL; child_basicblock = LLVMNextDomChild(bb_iter,child_basicblock))
-            {
-                check_instructions_with_rest(inst_iter,false,child_basicblock);
-            }
+            return L == R;
         }
-        //Checking the CSE of an instruction with all the instructions in the other basic blocks which are dominated.
-        else
-        {   
-            LLVMValueRef child_inst_iter = LLVMGetFirstInstruction(bb_iter);
-            while(child_inst_iter != NULL)
-            {
-                //If they are same, then we can perform the optimization.
-                if(common_subexpressions(child_inst_iter,inst_iter))
-                {
-                    //Replacing all the uses of the instruction with the value from the common instruction.
-                    unwrap(child_inst_iter)->replaceAllUsesWith(unwrap(inst_iter));
-                    //Increment the counter.
-                    CSEElim++;
-                    //Removing the redundant instructions.
-                    auto remove_instruction = dyn_cast<Instruction>(unwrap(child_inst_iter));
-                    child_inst_iter = LLVMGetNextInstruction(child_inst_iter);
-                    remove_instruction->eraseFromParent();
-                    continue;
-                }
-                child_inst_iter = LLVMGetNextInstruction(child_inst_iter);
-            } 
-            //Checking the basic blocks which are dominated by this child basic block.
-            LLVMBasicBlockRef child_basicblock;
-            for(child_basicblock = LLVMFirstDomChild(bb_iter); child_basicblock != NULL; child_basicblock = LLVMNextDomChild(bb_iter,child_basicblock))
-            {
-                check_instructions_with_rest(inst_iter,false,child_basicblock);
-            } 
+        if(!L->isSameOperationAs(R))
+        {
+            return false;
+        }
+        SmallVector<Value *, 4> left_operands, right_operands;
+        canonical_operands(L,left_operands);
+        canonical_operands(R,right_operands);
+        return left_operands == right_operands;
+    }
+};
+}
+
+//Expressions available in the block being visited, from it and the blocks dominating it. Every block of the dominator
+//tree opens a scope, which is popped when the walk leaves its subtree.
+typedef ScopedHashTable<cse_expression, Instruction *> cse_table;
+
+//Replaces the instructions of a block whose expression is already available by the available instruction, the others
+//become available to the rest of the block and the blocks it dominates.
+void CSE_Block(BasicBlock *block, cse_table &available)
+{
+    for(Instruction &I: make_early_inc_range(*block))
+    {
+        if(!cse_candidate(&I))
+        {
+            continue;
+        }
+        if(Instruction *leader = available.lookup({&I}))
+        {
+            //The flags (nsw, exact, fast-math) which the removed instruction doesn't have may not hold for its uses.
+            leader->andIRFlags(&I);
+            I.replaceAllUsesWith(leader);
+            //Increment the counter.
+            CSEElim++;
+            I.eraseFromParent();
+            continue;
         }
+        available.insert({&I},&I);
     }
 }
+
 //Common Sub Expression Elimination - Optimization 1.2
+//Global value numbering over a scoped hash table in one preorder walk of the dominator tree, so every instruction is
+//looked up once and the cost is linear in the size of the function. An instruction can reuse any identical instruction
+//of a block which dominates it, or earlier in its own block.
 void CSE_Eliminate(Module *module)
 {
-    LLVMModuleRef mod = wrap(module);
-    LLVMValueRef  fn_iter; 
     //Iterating through the functions inside a module.
-    for (fn_iter = LLVMGetFirstFunction(mod); fn_iter!=NULL; fn_iter = LLVMGetNextFunction(fn_iter))
+    for(auto &function: *module)
     {
-        //Iterating through the basic blocks inside a function.
-        LLVMBasicBlockRef bb_iter; /* points to each basic block one at a time */
-        for (bb_iter = LLVMGetFirstBasicBlock(fn_iter); bb_iter != NULL; bb_iter = LLVMGetNextBasicBlock(bb_iter))
-        { 
-            //Iterating through the Instructions inside a basic blocks.
-            LLVMValueRef inst_iter = LLVMGetFirstInstruction(bb_iter);
-            while(inst_iter != NULL) 
+        if(function.isDeclaration())
+        {
+            continue;
+        }
+        DominatorTree dominators(function);
+        cse_table available;
+        //Explicit stack of the walk, deep dominator trees of large functions would overflow a recursion.
+        struct walk_node
+        {
+            DomTreeNode *node;
+            DomTreeNode::const_iterator next_child;
+            std::unique_ptr<cse_table::ScopeTy> scope;
+        };
+        std::vector<walk_node> stack;
+        auto visit = [&](DomTreeNode *node) {
+            stack.push_back({node,node->begin(),std::make_unique<cse_table::ScopeTy>(available)});
+            CSE_Block(node->getBlock(),available);
+        };
+        visit(dominators.getRootNode());
+        while(!stack.empty())
+        {
+            walk_node &top = stack.back();
+            if(top.next_child == top.node->end())
             {
-                //Perform CSE using recursive algorithm.
-                check_instructions_with_rest(inst_iter,true,bb_iter);
-                inst_iter = LLVMGetNextInstruction(inst_iter);
+                //Leaving the subtree pops the scope of its root.
+                stack.pop_back();
+                continue;
             }
+            DomTreeNode *child = *top.next_child++;
+            visit(child);
         }
     }
 }